@@ -291,6 +291,19 @@ int tier_set_fd(int fd, char *datafile, int devicenr)
 		return -1;
 	}
 
+	res = s_pread(ffd, &tier_magic, sizeof(tier_magic), 0);
+	if (res != sizeof(tier_magic))
+		die_syserr();
+	/* The lists are not at the end of the device, but user data is */
+	if (tier_magic.external_meta) {
+		fprintf(stderr, "Device %s keeps its bitlist and blocklist on "
+				"a metadata device, not supported\n",
+			datafile);
+		close(ffd);
+		errno = EINVAL;
+		return -1;
+	}
+
 	bitlistsize = calc_bitlist_size(devsize);
 	soffset = devsize - bitlistsize;
 	if (mkoptions.backup) {
@@ -35,6 +35,7 @@ struct backing_device {
 	u64 startofdata;
 	u64 startofbitlist;
 	u64 startofblocklist;
+	unsigned int tier_group;
 	char *datafile;
 };
 
@@ -48,6 +49,9 @@ struct option_info {
 	int backdev_count;
 	u64 total_device_size;
 	u64 bitlistsize_total;
+	char *metadevice;
+	int meta_fd;
+	u64 metasize;
 };
 
 void *s_malloc(size_t size)
@@ -151,7 +155,7 @@ void write_device_magic(int fd, u64 total_device_size, unsigned int devicenr,
 	block = s_malloc(BLKSIZE);
 	memset(block, 0, BLKSIZE);
 	memset(&magic, 0, sizeof(struct devicemagic));
-	magic.magic = TIER_DEVICE_BIT_MAGIC;
+	magic.magic = TIER_DEVICE_PACKED_MAGIC;
 	magic.device = devicenr;
 	magic.total_device_size = total_device_size;
 	magic.clean = CLEAN;
@@ -160,6 +164,8 @@ void write_device_magic(int fd, u64 total_device_size, unsigned int devicenr,
 	magic.blocklistsize = blocklistsize;
 	magic.startofblocklist = bdev->startofblocklist;
 	magic.startofbitlist = bdev->startofbitlist;
+	magic.tier_group = bdev->tier_group;
+	magic.external_meta = NULL != mkoptions.metadevice;
 	if (strlen(bdev->datafile) > 1024)
 		exit(-ENAMETOOLONG);
 	memcpy(&magic.fullpathname, bdev->datafile, strlen(bdev->datafile));
@@ -188,6 +194,62 @@ void clear_list(int fd, u64 size, u64 soffset)
 	free(block);
 }
 
+/* Convert the byte per block bitlist of a device to a packed bitlist.
+   The device is marked dirty while converting, so that the bitlist
+   is rebuilt from the blocklist when the conversion is interrupted */
+void convert_bitlist(int ffd, char *datafile, struct devicemagic *tier_magic)
+{
+	unsigned char *block;
+	unsigned char *packed;
+	unsigned int clean = tier_magic->clean;
+	u64 size = TIER_BITLIST_BYTES(tier_magic->bitlistsize);
+	u64 offset;
+	int i;
+	int res;
+
+	printf("Converting bitlist of device   : %s\n", datafile);
+	tier_magic->magic = TIER_DEVICE_PACKED_MAGIC;
+	tier_magic->clean = DIRTY;
+	res = s_pwrite(ffd, tier_magic, sizeof(*tier_magic), 0);
+	if (res != sizeof(*tier_magic))
+		die_syserr();
+	if (0 != fsync(ffd))
+		die_syserr();
+
+	block = s_malloc(BLKSIZE);
+	packed = s_malloc(size);
+	memset(packed, 0, size);
+	tier_magic->allocated_blocks = 0;
+	for (offset = 0; offset < tier_magic->bitlistsize;
+	     offset += BLKSIZE) {
+		res = s_pread(ffd, block, BLKSIZE,
+			      tier_magic->startofbitlist + offset);
+		if (res != BLKSIZE)
+			die_syserr();
+		for (i = 0; i < BLKSIZE; i++) {
+			if (ALLOCATED != block[i])
+				continue;
+			packed[(offset + i) >> 3] |= 1 << ((offset + i) & 7);
+			tier_magic->allocated_blocks++;
+		}
+	}
+	clear_list(ffd, tier_magic->bitlistsize, tier_magic->startofbitlist);
+	res = s_pwrite(ffd, packed, size, tier_magic->startofbitlist);
+	if (res != size)
+		die_syserr();
+	if (0 != fsync(ffd))
+		die_syserr();
+	free(packed);
+	free(block);
+
+	tier_magic->clean = clean;
+	res = s_pwrite(ffd, tier_magic, sizeof(*tier_magic), 0);
+	if (res != sizeof(*tier_magic))
+		die_syserr();
+	if (0 != fsync(ffd))
+		die_syserr();
+}
+
 int tier_set_fd(int fd, char *datafile, int devicenr)
 {
 	struct fd_s fds;
@@ -235,7 +297,9 @@ int tier_set_fd(int fd, char *datafile, int devicenr)
 	}
 
 	bitlistsize = calc_bitlist_size(devsize);
-	if (mkoptions.create) {
+	if (mkoptions.create && mkoptions.metadevice) {
+		/* The bitlist is cleared on the metadata device */
+	} else if (mkoptions.create) {
 		soffset = devsize - bitlistsize;
 		printf("Clearing bitlist of device     : %s\n     offset       "
 		       "             : 0x%llx (%llu)\n     device size         "
@@ -248,7 +312,9 @@ int tier_set_fd(int fd, char *datafile, int devicenr)
 		res = s_pread(ffd, &tier_magic, sizeof(tier_magic), 0);
 		if (res != sizeof(tier_magic))
 			die_syserr();
-		if (tier_magic.magic != TIER_DEVICE_BIT_MAGIC) {
+		if (tier_magic.magic == TIER_DEVICE_BIT_MAGIC)
+			convert_bitlist(ffd, datafile, &tier_magic);
+		if (tier_magic.magic != TIER_DEVICE_PACKED_MAGIC) {
 			fprintf(stderr, "Datastore %s has invalid magic, not a "
 					"tier device\n",
 				datafile);
@@ -270,6 +336,77 @@ int tier_set_fd(int fd, char *datafile, int devicenr)
 	return 0;
 }
 
+/* Open the metadata device and hand it to the kernel */
+int tier_set_metafd(int fd)
+{
+	struct fd_s fds;
+	int mode = O_RDWR | O_NOATIME;
+	u64 devsize;
+
+	if (mkoptions.sync)
+		mode |= O_SYNC;
+	fds.fd = open(mkoptions.metadevice, mode, 0600);
+	if (fds.fd < 0) {
+		fprintf(stderr, "Failed to open metadata device %s\n",
+			mkoptions.metadevice);
+		return -1;
+	}
+	devsize = lseek64(fds.fd, 0, SEEK_END);
+	if (-1 == devsize) {
+		fprintf(stderr, "Error while opening %s : %s\n",
+			mkoptions.metadevice, strerror(errno));
+		close(fds.fd);
+		return -1;
+	}
+	mkoptions.meta_fd = fds.fd;
+	mkoptions.metasize = round_to_blksize(devsize);
+	if (ioctl(fd, TIER_SET_METAFD, &fds) < 0) {
+		fprintf(stderr,
+			"ioctl TIER_SET_METAFD failed on /dev/tiercontrol\n");
+		close(fds.fd);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Clear the metadata of a new device on the metadata device, its header
+ * and journal slots, the bitlists and the blocklist.
+ */
+void init_metadevice(u64 metalistsize)
+{
+	char *block;
+	struct devicemagic magic;
+	int res;
+
+	if (metalistsize > mkoptions.metasize) {
+		fprintf(stderr, "Metadata device %s is too small, it needs "
+				"0x%llx (%llu) bytes\n",
+			mkoptions.metadevice, metalistsize, metalistsize);
+		exit(-1);
+	}
+	printf("Clearing metadata device       : %s\n     size             "
+	       "         : 0x%llx (%llu)\n\n",
+	       mkoptions.metadevice, metalistsize, metalistsize);
+	clear_list(mkoptions.meta_fd, metalistsize, 0);
+
+	block = s_malloc(BLKSIZE);
+	memset(block, 0, BLKSIZE);
+	memset(&magic, 0, sizeof(struct devicemagic));
+	magic.magic = TIER_DEVICE_META_MAGIC;
+	magic.device = mkoptions.backdev_count + 1;
+	magic.clean = CLEAN;
+	magic.devicesize = mkoptions.metasize;
+	magic.blocklistsize = mkoptions.blocklistsize;
+	memcpy(&magic.fullpathname, mkoptions.metadevice,
+	       strlen(mkoptions.metadevice));
+	memcpy(block, &magic, sizeof(struct devicemagic));
+	res = s_pwrite(mkoptions.meta_fd, block, BLKSIZE, 0);
+	if (res != BLKSIZE)
+		die_syserr();
+	free(block);
+}
+
 int tier_setup(int op, int fd, int devicenr)
 {
 	int ffd, i;
@@ -345,27 +482,36 @@ void usage(char *name)
 	       "blockdevice. No more then 16 devices are supported.\n");
 	printf("         specify the fastest storage first. E.g. -f "
 	       "/dev/ssd:/dev/sas:/dev/sata.\n");
+	printf("         devices joined with + form one tier, e.g. -f "
+	       "/dev/ssd1+/dev/ssd2:/dev/sata.\n");
+	printf("         -m metadev keeps the metadata of all devices on "
+	       "metadev.\n");
 	printf("Detach : %s -d /dev/tier_device_name\n", name);
 	exit(-1);
 }
 
+/* Devices joined with + share tier group tier, 0 for a device on its own */
 void parse_datafile(char *optarg)
 {
-	char *cur = NULL;
-	cur = strtok(optarg, ":");
-	if (!cur) {
-		mkoptions.backdev[0] = s_malloc(sizeof(struct backing_device));
-		mkoptions.backdev[mkoptions.backdev_count]->datafile = optarg;
-		mkoptions.backdev_count++;
-		return;
-	}
-	while (cur) {
-		mkoptions.backdev[mkoptions.backdev_count] =
-		    s_malloc(sizeof(struct backing_device));
-		mkoptions.backdev[mkoptions.backdev_count]->datafile =
-		    as_sprintf("%s", cur);
-		mkoptions.backdev_count++;
-		cur = strtok(NULL, ":");
+	char *tier, *cur;
+	char *tiers, *members;
+	unsigned int group = 0;
+	int joined;
+
+	for (tier = strtok_r(optarg, ":", &tiers); tier;
+	     tier = strtok_r(NULL, ":", &tiers)) {
+		group++;
+		joined = NULL != strchr(tier, '+');
+		for (cur = strtok_r(tier, "+", &members); cur;
+		     cur = strtok_r(NULL, "+", &members)) {
+			mkoptions.backdev[mkoptions.backdev_count] =
+			    s_malloc(sizeof(struct backing_device));
+			mkoptions.backdev[mkoptions.backdev_count]->datafile =
+			    as_sprintf("%s", cur);
+			mkoptions.backdev[mkoptions.backdev_count]
+			    ->tier_group = joined ? group : 0;
+			mkoptions.backdev_count++;
+		}
 	}
 	mkoptions.backdev_count--;
 }
@@ -376,7 +522,7 @@ int get_opts(int argc, char *argv[])
 	int c, ret = 0;
 	int has_devices = 0;
 
-	while ((c = getopt(argc, argv, "cd:hf:z:")) != -1)
+	while ((c = getopt(argc, argv, "cd:hf:m:z:")) != -1)
 		switch (c) {
 		case 'c':
 			mkoptions.create = 1;
@@ -402,6 +548,14 @@ int get_opts(int argc, char *argv[])
 			}
 
 			break;
+		case 'm':
+			if (optopt == 'm')
+				printf("Option -%c requires a device as "
+				       "argument.\n",
+				       optopt);
+			else
+				mkoptions.metadevice = optarg;
+			break;
 		case 'z':
 			if (optopt == 'z')
 				printf("Option -%c requires sector size as "
@@ -552,14 +706,34 @@ int main(int argc, char *argv[])
 			die_ioctlerr("ioctl TIER_SET_SECTORSIZE failed\n");
 	}
 
-	mkoptions.blocklistsize = calc_blocklist_size(
-	    mkoptions.total_device_size, mkoptions.bitlistsize_total);
-	mkoptions.total_device_size = round_to_blksize(
-	    mkoptions.total_device_size - mkoptions.bitlistsize_total -
-	    mkoptions.blocklistsize - (mkoptions.backdev_count * header_size));
+	if (mkoptions.metadevice) {
+		if (0 != tier_set_metafd(fd))
+			die_ioctlerr("ioctl TIER_SET_METAFD failed\n");
+		/* The devices only hold data, the lists are on the metadev */
+		mkoptions.total_device_size = round_to_blksize(
+		    mkoptions.total_device_size -
+		    (mkoptions.backdev_count * header_size));
+		mkoptions.blocklistsize =
+		    (mkoptions.total_device_size >> BLK_SHIFT) *
+		    sizeof(struct physical_blockinfo);
+		if (mkoptions.blocklistsize >
+		    round_to_blksize(mkoptions.blocklistsize))
+			mkoptions.blocklistsize =
+			    round_to_blksize(mkoptions.blocklistsize) + BLKSIZE;
+	} else {
+		mkoptions.blocklistsize = calc_blocklist_size(
+		    mkoptions.total_device_size, mkoptions.bitlistsize_total);
+		mkoptions.total_device_size = round_to_blksize(
+		    mkoptions.total_device_size - mkoptions.bitlistsize_total -
+		    mkoptions.blocklistsize -
+		    (mkoptions.backdev_count * header_size));
+	}
 	printf("Total device size              : 0x%llx (%llu)\n",
 	       mkoptions.total_device_size, mkoptions.total_device_size);
-	if (mkoptions.create) {
+	if (mkoptions.create && mkoptions.metadevice) {
+		init_metadevice(header_size + mkoptions.bitlistsize_total +
+				mkoptions.blocklistsize);
+	} else if (mkoptions.create) {
 		soffset = mkoptions.backdev[0]->devicesize -
 			  mkoptions.backdev[0]->bitlistsize -
 			  mkoptions.blocklistsize;
@@ -571,14 +745,23 @@ int main(int argc, char *argv[])
 		clear_list(mkoptions.backdev[0]->tier_dta_file,
 			   mkoptions.blocklistsize, soffset);
 	}
+	soffset = header_size;
 	for (count = 0; count <= mkoptions.backdev_count; count++) {
 		mkoptions.backdev[count]->startofdata = header_size;
-		mkoptions.backdev[count]->startofbitlist =
-		    mkoptions.backdev[count]->devicesize -
-		    mkoptions.backdev[count]->bitlistsize;
-		mkoptions.backdev[count]->startofblocklist =
-		    mkoptions.backdev[0]->devicesize -
-		    mkoptions.backdev[0]->bitlistsize - mkoptions.blocklistsize;
+		if (mkoptions.metadevice) {
+			mkoptions.backdev[count]->startofbitlist = soffset;
+			soffset += mkoptions.backdev[count]->bitlistsize;
+			mkoptions.backdev[count]->startofblocklist =
+			    header_size + mkoptions.bitlistsize_total;
+		} else {
+			mkoptions.backdev[count]->startofbitlist =
+			    mkoptions.backdev[count]->devicesize -
+			    mkoptions.backdev[count]->bitlistsize;
+			mkoptions.backdev[count]->startofblocklist =
+			    mkoptions.backdev[0]->devicesize -
+			    mkoptions.backdev[0]->bitlistsize -
+			    mkoptions.blocklistsize;
+		}
 		if (mkoptions.create) {
 			printf("write_device_magic device      : %u\n     size "
 			       "                     : 0x%llx (%llu)\n",
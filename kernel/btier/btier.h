@@ -20,18 +20,23 @@
 #include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/gfp.h>
+#include <linux/hash.h>
 #include <linux/hdreg.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/mempool.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/pmem.h>
+#include <linux/radix-tree.h>
 #include <linux/rwsem.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/spinlock.h>
 #include <linux/sysfs.h>
 #include <linux/types.h>
@@ -72,14 +77,62 @@ typedef unsigned long u32;
 #define TIER_BARRIER 0xFE08
 #define TIER_CACHESIZE 0xFE09
 #define TIER_SET_SECTORSIZE 0xFE0A
+#define TIER_SET_METAFD 0xFE0B
 #define TIER_HEADERSIZE 1048576
+/* Device with a bitlist of one byte per block, converted by btier_setup */
 #define TIER_DEVICE_BIT_MAGIC 0xabe
+/* Device with a bitlist of one bit per block */
+#define TIER_DEVICE_PACKED_MAGIC 0xabf
+/*
+ * Metadata device. It starts with its own devicemagic, followed by a
+ * journal slot of TIER_JOURNAL_SLOT bytes per tier. The bitlists and
+ * the blocklist follow TIER_HEADERSIZE.
+ */
+#define TIER_DEVICE_META_MAGIC 0xac0
+#define TIER_JOURNAL_SLOT 4096
 #define TIER_DEVICE_BLOCK_MAGIC 0xafdf
 
+/*
+ * The bitlist area of a device still has room for one byte per block, the
+ * packed bitlist only uses the first TIER_BITLIST_BYTES of it.
+ * Bit n of the bitlist is bit n % 8 of byte n / 8.
+ */
+#define TIER_BITLIST_BYTES(bitlistsize) ((bitlistsize) >> 3)
+
 #define WD 1 /* Write disk */
 #define WC 2 /* Write cache */
 #define WA 3 /* All: Cache and disk */
 
+/* Number of blocks of a discard that share one metadata update */
+#define TIER_DISCARD_BATCH 16384
+
+/* Granularity at which partial discards of a block are tracked */
+#define TIER_TRIM_UNIT 4096
+#define TIER_TRIM_BITS (BLKSIZE / TIER_TRIM_UNIT)
+/* Entries of the trim and shadow trees that are looked up at once */
+#define TIER_TREE_GANG 16
+
+/*
+ * Number of free blocks that a sequential stream looks for when it can't
+ * continue right behind its previous block
+ */
+#define TIER_ALLOC_RUN 16
+
+/* Number of blocks that are migrated together, sorted by their offset */
+#define TIER_MIGRATE_BATCH 64
+
+/* Tag of a shadow in shadow_tree whose block was written after promotion */
+#define SHADOW_STALE 0
+
+/* Default number of blocks that the defragmenter moves per round */
+#define TIER_DEFRAG_RATE 64
+
+/* Number of blocklist entries that the defragmenter looks at per round */
+#define TIER_DEFRAG_SCAN (1 << 16)
+
+/* Number of hashed block locks per possible cpu */
+#define BTIER_BLOCK_LOCKS_PER_CPU 256
+
 #define BTIER_MAX_DEVS 26
 #define BTIER_MAX_INFLIGHT 256
 
@@ -102,6 +155,7 @@ typedef unsigned long u32;
 #define EST 1
 #define DIS 2
 
+/* Entries of the old byte per block bitlist */
 #define ALLOCATED 0xff
 #define UNALLOCATED 0x00
 #define MAXPAGESHOW 20
@@ -188,6 +242,11 @@ struct devicemagic {
 	char fullpathname[1025];
 	struct data_policy dtapolicy;
 	char uuid[24];
+	u64 allocated_blocks; /* Only valid when clean */
+	unsigned int tier_group; /* Adjacent devices with the same non zero
+				    group share one tier level */
+	unsigned int external_meta; /* The bitlist, blocklist and journal
+				       are on the metadata device */
 } __attribute__((packed));
 
 struct fd_s {
@@ -206,6 +265,16 @@ struct bio_task {
 	// int in_one;
 };
 
+/*
+ * Completion hook of a bio that is remapped in place, it holds what is
+ * needed to give the bio back to its owner.
+ */
+struct bio_remap {
+	struct tier_device *dev;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+};
+
 typedef struct {
 	struct file *fp;
 	mm_segment_t fs;
@@ -213,13 +282,15 @@ typedef struct {
 
 /*
  * This structure has same members as physical_blockinfo, other than the
- * reserved, the order of members is intended to remove unaligned memory
+ * seq, the order of members is intended to remove unaligned memory
  * access on 64 bit machine;
- * The addition of reserved won't increase memory, due to kmalloc paddings,
+ * The addition of seq won't increase memory, due to kmalloc paddings,
  * but adding any one more member later will double its actual size.
+ * seq is odd while the mapping (device, offset) is being changed, see
+ * binfo_write_begin.
  */
 struct blockinfo {
-	u32 reserved;
+	u32 seq;
 	unsigned int device;
 	u64 offset;
 	time_t lastused;
@@ -227,6 +298,47 @@ struct blockinfo {
 	unsigned int writecount;
 };
 
+/*
+ * The blocklist is kept in memory in segments of BLOCKLIST_SEGMENT_BLOCKS
+ * entries. A segment is read from disk on first access and stays in memory
+ * until shrink_blocklist evicts or compacts it, see blocklist_entry.
+ */
+#define BLOCKLIST_SEGMENT_SHIFT 12
+#define BLOCKLIST_SEGMENT_BLOCKS (1 << BLOCKLIST_SEGMENT_SHIFT)
+
+struct blocklist_segment {
+	/* entries that have only been changed in memory */
+	DECLARE_BITMAP(dirty, BLOCKLIST_SEGMENT_BLOCKS);
+	struct blockinfo binfo[BLOCKLIST_SEGMENT_BLOCKS];
+};
+
+/*
+ * A clean segment can also be kept as extents, runs of blocks that are
+ * stored back to back on one device, next to the statistics of every
+ * block in a compact array. Such a segment is read only, the first
+ * access through blocklist_entry expands it again.
+ */
+#define BLOCKLIST_MAX_EXTENTS (BLOCKLIST_SEGMENT_BLOCKS / 4)
+
+struct blocklist_extent {
+	u32 first; /* entry of the first block in the segment */
+	u32 blocks;
+	unsigned int device;
+	u64 offset; /* of the first block */
+};
+
+struct block_heat {
+	u32 lastused;
+	u32 readcount;
+	u32 writecount;
+};
+
+struct blocklist_extents {
+	unsigned int count;
+	struct block_heat heat[BLOCKLIST_SEGMENT_BLOCKS];
+	struct blocklist_extent extent[0];
+};
+
 struct bio_meta {
 	struct work_struct work;
 	struct completion event;
@@ -239,9 +351,19 @@ struct bio_meta {
 	u64 offset;
 	u64 blocknr;
 	unsigned int size;
+	unsigned int newdevice;
 	unsigned flush : 1;
 	unsigned discard : 1;
 	unsigned allocate : 1;
+	unsigned redirect : 1;
+	unsigned load : 1;
+};
+
+/* A block released by discard, device is 0 based */
+struct freed_block {
+	unsigned int device;
+	u64 offset;
+	u64 blocknr; /* only set by discard */
 };
 
 struct backing_device {
@@ -258,12 +380,35 @@ struct backing_device {
 	unsigned int dirty;
 	struct devicemagic *devmagic;
 	spinlock_t magic_lock;
-	struct blockinfo **blocklist;
-	u8 *bitlist;
-	/* dev_alloc_lock, protects bitlist, usedoffset and free_offset*/
+	/* bitmap of allocated blocks, little endian bit order like on disk */
+	unsigned long *bitlist;
+	/* number of bits set in bitlist */
+	u64 allocated_blocks;
+	/* dev_alloc_lock, protects bitlist, allocated_blocks, usedoffset
+	   and free_offset*/
 	spinlock_t dev_alloc_lock;
+	/* orders writes of bitlist bytes to disk */
+	struct mutex bitlist_mutex;
 	unsigned int ra_pages;
 	struct block_device *bdev;
+	/* queue limits of bdev, in bytes and segments per bio */
+	unsigned int max_chunk;
+	unsigned int max_segments;
+	/* tier level, shared by the devices of a tier group */
+	unsigned int level;
+	/* holds the bitlist, blocklist and journal, fds or the metadata
+	   device */
+	struct file *metafds;
+	u64 journal_offset;
+	/* metadata device mapped as persistent memory, or NULL */
+	void __pmem *pmem;
+	u64 pmem_size;
+};
+
+/* The backing devices first .. first + members - 1 form one tier level */
+struct tier_level {
+	unsigned int first;
+	unsigned int members;
 };
 
 struct tier_stats {
@@ -273,6 +418,14 @@ struct tier_stats {
 	atomic64_t rand_writes;
 };
 
+/* A block that walk_blocklist selected to move to newdevice */
+struct migrate_candidate {
+	u64 blocknr;
+	u64 offset;
+	unsigned int device;
+	unsigned int newdevice;
+};
+
 struct migrate_direct {
 	u64 blocknr;
 	int newdevice;
@@ -286,6 +439,10 @@ struct tier_device {
 	int tier_device_number;
 	int active;
 	int attached_devices;
+	struct tier_level level[BTIER_MAX_DEVS];
+	unsigned int levels;
+	/* optional device that holds the metadata of all tiers */
+	struct backing_device *metadev;
 
 	int (*ioctl)(struct tier_device *, int cmd, u64 arg);
 
@@ -295,8 +452,26 @@ struct tier_device {
 	struct block_device *tier_device;
 	u64 size;
 	u64 blocklistsize;
-	/* block lock for per block meta data*/
+	/* hashed block locks for per block meta data, see tier_block_lock */
 	struct mutex *block_lock;
+	unsigned int block_lock_bits;
+	/* write_blocklist (shared) vs write_blocklist_range (exclusive) */
+	struct rw_semaphore blocklist_lock;
+	/* segments of the blocklist, NULL while not loaded */
+	struct blocklist_segment **segments;
+	/* segments kept as extents, outdated once the segment is loaded */
+	struct blocklist_extents **extents;
+	/* segments without allocated blocks on disk */
+	unsigned long *empty_segments;
+	/* segments with dirty entries */
+	unsigned long *dirty_segments;
+	/* segments used by io since the clock hand passed them */
+	unsigned long *referenced_segments;
+	u64 segment_clock;
+	/* bytes used by the loaded segments and extents */
+	atomic64_t blocklist_memory;
+	/* memory for the blocklist segments in MB, 0 is unlimited */
+	unsigned int blocklist_cache_mb;
 	spinlock_t dbg_lock;
 
 	struct gendisk *gd;
@@ -308,6 +483,8 @@ struct tier_device {
 	mempool_t *bio_task;
 	/* mempool for bio_meta data structure*/
 	mempool_t *bio_meta;
+	/* mempool for bio_remap data structure*/
+	mempool_t *bio_remap;
 
 	char *devname;
 	char *managername;
@@ -330,6 +507,9 @@ struct tier_device {
 	struct tier_stats stats;
 
 	u64 resumeblockwalk;
+	/* Blocks relocated per migration round by the defragmenter */
+	unsigned int defrag_rate;
+	u64 resumedefrag;
 	struct rw_semaphore qlock;
 	wait_queue_head_t migrate_event;
 	wait_queue_head_t aio_event;
@@ -340,9 +520,19 @@ struct tier_device {
 
 	int discard_to_devices;
 	int discard;
+	/* bitmaps of partially discarded blocks, indexed by blocknr */
+	struct radix_tree_root trim_tree;
+	spinlock_t trim_lock;
+	atomic_t trimmed_blocks;
+	/* lower tier copies of promoted blocks, indexed by blocknr */
+	struct radix_tree_root shadow_tree;
+	spinlock_t shadow_lock;
+	atomic_t shadowed_blocks;
 
 	/* Where do we initially store sequential IO */
 	int inerror;
+	/* A device was not cleanly shut down, the bitlists need a repair */
+	int unclean_shutdown;
 
 	/* The blocknr that the user can retrieve info for via sysfs*/
 	u64 user_selected_blockinfo;
@@ -355,28 +545,98 @@ struct tier_work {
 	struct tier_device *device;
 };
 
+/*
+ * The lock protecting the meta data of blocknr. Different blocks can
+ * share a lock, so while one block lock is held further ones may only be
+ * taken with mutex_trylock. A failed trylock, also on a lock that is held
+ * already, has to be handled by not using that block.
+ */
+static inline struct mutex *tier_block_lock(struct tier_device *dev,
+					    u64 blocknr)
+{
+	return dev->block_lock + hash_64(blocknr, dev->block_lock_bits);
+}
+
+/* The blockinfo of blocknr has to be written back by flush_blocklist */
+static inline void mark_blockinfo_dirty(struct tier_device *dev, u64 blocknr)
+{
+	u64 seg = blocknr >> BLOCKLIST_SEGMENT_SHIFT;
+	unsigned int entry = blocknr & (BLOCKLIST_SEGMENT_BLOCKS - 1);
+	struct blocklist_segment *segment = dev->segments[seg];
+
+	if (!test_bit(entry, segment->dirty))
+		set_bit(entry, segment->dirty);
+	if (!test_bit(seg, dev->dirty_segments))
+		set_bit(seg, dev->dirty_segments);
+}
+
+/* The segment of blocknr is in use, see shrink_blocklist */
+static inline void mark_segment_referenced(struct tier_device *dev,
+					   u64 blocknr)
+{
+	u64 seg = blocknr >> BLOCKLIST_SEGMENT_SHIFT;
+
+	if (!test_bit(seg, dev->referenced_segments))
+		set_bit(seg, dev->referenced_segments);
+}
+
+/*
+ * Mapping changes that can run concurrently with io (allocation and
+ * discard) are made under the block lock and between binfo_write_begin
+ * and binfo_write_end. Reads check the mapping without the block lock,
+ * and retry with the lock when seq has changed.
+ * Data migration does not need this, it excludes all io with qlock.
+ */
+static inline void binfo_write_begin(struct blockinfo *binfo)
+{
+	WRITE_ONCE(binfo->seq, binfo->seq + 1);
+	smp_wmb();
+}
+
+static inline void binfo_write_end(struct blockinfo *binfo)
+{
+	smp_wmb();
+	WRITE_ONCE(binfo->seq, binfo->seq + 1);
+}
+
 extern struct workqueue_struct *btier_wq;
 extern struct kmem_cache *bio_task_cache;
 
-unsigned int get_chunksize(struct block_device *bdev, struct bio *bio);
+unsigned int get_chunksize(struct backing_device *backdev, struct bio *bio,
+			   unsigned int max);
 int tier_moving_block(struct tier_device *dev, struct blockinfo *olddevice,
 		      struct blockinfo *newdevice);
 struct blockinfo *get_blockinfo(struct tier_device *, u64, int);
+int binfo_sanity(struct tier_device *, struct blockinfo *);
 blk_qc_t tier_make_request(struct request_queue *q, struct bio *old_bio);
 void tier_request_exit(void);
+void free_trim_tree(struct tier_device *dev);
+int cmp_freed_block(const void *a, const void *b);
 int tier_request_init(void);
 
 int write_blocklist(struct tier_device *, u64, struct blockinfo *, int);
+int write_blocklist_range(struct tier_device *, u64, u64);
+int flush_blocklist(struct tier_device *);
+struct blockinfo *blocklist_entry(struct tier_device *, u64);
+bool blocklist_peek(struct tier_device *, u64, struct blockinfo *);
+bool blocklist_needs_read(struct tier_device *, u64);
+void load_segments(struct tier_device *, u64, u64);
+bool blocklist_segment_empty(struct tier_device *, u64);
 void set_debug_info(struct tier_device *dev, int state);
 void clear_debug_info(struct tier_device *dev, int state);
 int allocate_dev(struct tier_device *dev, u64 blocknr, struct blockinfo *binfo,
-		 int device);
+		 int device, int iotype);
+int group_member(struct tier_device *dev, unsigned int level, u64 blocknr);
+u64 fragmentation_of_device(struct tier_device *dev, int device);
 void tiererror(struct tier_device *dev, char *msg);
 int tier_sync(struct tier_device *dev);
 void discard_on_real_device(struct tier_device *dev, struct blockinfo *binfo);
 void clear_dev_list(struct tier_device *dev, struct blockinfo *binfo);
+int clear_dev_list_batch(struct tier_device *dev, struct freed_block *blocks,
+			 unsigned int count);
 void reset_counters_on_migration(struct tier_device *dev,
 				 struct blockinfo *binfo);
+void shadow_stale(struct tier_device *dev, u64 blocknr);
 
 void free_bitlists(struct tier_device *);
 void resize_tier(struct tier_device *);
@@ -385,6 +645,9 @@ void *as_sprintf(const char *, ...);
 u64 allocated_on_device(struct tier_device *, int);
 void btier_clear_statistics(struct tier_device *dev);
 int migrate_direct(struct tier_device *, u64, int);
+unsigned int overwrite_target(struct tier_device *, struct blockinfo *);
+int redirect_block(struct tier_device *, u64, struct blockinfo *,
+		   struct blockinfo *);
 char *tiger_hash(char *, unsigned int);
 void btier_lock(struct tier_device *);
 void btier_unlock(struct tier_device *);
@@ -27,6 +27,17 @@
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Mark Ruijter");
 
+static bool lazy_blocklist;
+module_param(lazy_blocklist, bool, 0644);
+MODULE_PARM_DESC(lazy_blocklist,
+		 "Load the blocklist on first access instead of on register");
+
+static unsigned int blocklist_cache_mb;
+module_param(blocklist_cache_mb, uint, 0644);
+MODULE_PARM_DESC(blocklist_cache_mb,
+		 "Default memory for the blocklist of a device in MB, 0 is "
+		 "unlimited");
+
 LIST_HEAD(device_list);
 DEFINE_MUTEX(tier_devices_mutex);
 struct workqueue_struct *btier_wq;
@@ -162,10 +173,15 @@ void btier_clear_statistics(struct tier_device *dev)
 	btier_lock(dev);
 
 	for (curblock = 0; curblock < blocks; curblock++) {
+		if (blocklist_over_budget(dev))
+			shrink_blocklist(dev);
+		if (blocklist_segment_empty(dev, curblock)) {
+			curblock |= BLOCKLIST_SEGMENT_BLOCKS - 1;
+			continue;
+		}
 		binfo = get_blockinfo(dev, curblock, 0);
-		if (dev->inerror) {
+		if (!binfo)
 			break;
-		}
 		if (binfo->device != 0) {
 			binfo->readcount = 0;
 			binfo->writecount = 0;
@@ -195,19 +211,24 @@ static struct devicemagic *read_device_magic(struct tier_device *dev,
 	dmagic = kzalloc(sizeof(struct devicemagic), GFP_KERNEL);
 	if (!dmagic)
 		return NULL;
-	tier_file_read(dev, device, dmagic, sizeof(*dmagic), 0);
+	__tier_file_read(dev, dev->backdev[device]->fds, dmagic, sizeof(*dmagic),
+			 0);
 	return dmagic;
 }
 
 static void write_device_magic(struct tier_device *dev, int device)
 {
 	struct devicemagic *dmagic = dev->backdev[device]->devmagic;
-	tier_file_write(dev, device, dmagic, sizeof(*dmagic), 0);
+	__tier_file_write(dev, dev->backdev[device]->fds, dmagic,
+			  sizeof(*dmagic), 0);
 }
 
 static void mark_device_clean(struct tier_device *dev, int device)
 {
 	struct backing_device *backdev = dev->backdev[device];
+	spin_lock(&backdev->dev_alloc_lock);
+	backdev->devmagic->allocated_blocks = backdev->allocated_blocks;
+	spin_unlock(&backdev->dev_alloc_lock);
 	backdev->devmagic->clean = CLEAN;
 	memset(&backdev->devmagic->binfo_journal_new, 0,
 	       sizeof(struct blockinfo));
@@ -216,22 +237,43 @@ static void mark_device_clean(struct tier_device *dev, int device)
 	write_device_magic(dev, device);
 }
 
-static int mark_offset_as_used(struct tier_device *dev, int device, u64 offset)
+/*
+ * Write the byte of the bitlist of device that holds slot to disk. The
+ * caller holds bitlist_mutex, so that the last write of a byte always
+ * carries the latest in memory state of all of its bits. When clear is
+ * set the bit of slot is written as cleared, the in memory bit is only
+ * cleared by the caller once the write is stable.
+ */
+static int write_bitlist_byte(struct tier_device *dev, int device, u64 slot,
+			      bool clear)
 {
-	u64 boffset;
-	u8 allocated = ALLOCATED;
 	struct backing_device *backdev = dev->backdev[device];
+	u8 *bitlist = (u8 *)backdev->bitlist;
+	u64 pos = backdev->startofbitlist + (slot >> 3);
+	u8 byte;
 	int ret;
 
-	boffset = offset >> BLK_SHIFT;
-	ret = tier_file_write(dev, device, &allocated, 1,
-			      backdev->startofbitlist + boffset);
-	ret = vfs_fsync_range(backdev->fds, backdev->startofbitlist + boffset,
-			      1, FSMODE);
-
 	spin_lock(&backdev->dev_alloc_lock);
-	backdev->bitlist[boffset] = allocated;
+	byte = bitlist[slot >> 3];
 	spin_unlock(&backdev->dev_alloc_lock);
+	if (clear)
+		byte &= ~(1 << (slot & 7));
+
+	ret = tier_file_write(dev, device, &byte, 1, pos);
+	if (ret)
+		return ret;
+	return tier_meta_sync(dev, device, pos, pos);
+}
+
+/* Persist slot of device as allocated, it is already set in memory */
+static int mark_offset_as_used(struct tier_device *dev, int device, u64 offset)
+{
+	struct backing_device *backdev = dev->backdev[device];
+	int ret;
+
+	mutex_lock(&backdev->bitlist_mutex);
+	ret = write_bitlist_byte(dev, device, offset >> BLK_SHIFT, false);
+	mutex_unlock(&backdev->bitlist_mutex);
 
 	return ret;
 }
@@ -240,91 +282,252 @@ void clear_dev_list(struct tier_device *dev, struct blockinfo *binfo)
 {
 	u64 offset;
 	u64 boffset;
-	u8 unallocated = UNALLOCATED;
 	struct backing_device *backdev = dev->backdev[binfo->device - 1];
 
 	offset = binfo->offset - backdev->startofdata;
 	boffset = offset >> BLK_SHIFT;
 
-	tier_file_write(dev, binfo->device - 1, &unallocated, 1,
-			backdev->startofbitlist + boffset);
-
-	vfs_fsync_range(backdev->fds, backdev->startofbitlist + boffset, 1,
-			FSMODE);
+	mutex_lock(&backdev->bitlist_mutex);
+	write_bitlist_byte(dev, binfo->device - 1, boffset, true);
 
 	spin_lock(&backdev->dev_alloc_lock);
 	if (backdev->free_offset > boffset)
 		backdev->free_offset = boffset;
-
-	if (backdev->bitlist)
-		backdev->bitlist[boffset] = unallocated;
+	if (__test_and_clear_bit_le(boffset, backdev->bitlist))
+		backdev->allocated_blocks--;
 	spin_unlock(&backdev->dev_alloc_lock);
+	mutex_unlock(&backdev->bitlist_mutex);
 }
 
-int allocate_dev(struct tier_device *dev, u64 blocknr, struct blockinfo *binfo,
-		 int device)
+/*
+ * Batched version of clear_dev_list. The freed blocks must be sorted on
+ * device and offset. The bitlist bytes that cover the freed blocks of a
+ * device are written a page at a time and every device is synced once.
+ * Only afterwards the blocks become available for allocation again, the
+ * blocks of a device whose bitlist could not be written stay allocated.
+ */
+int clear_dev_list_batch(struct tier_device *dev, struct freed_block *blocks,
+			 unsigned int count)
+{
+	struct backing_device *backdev;
+	u8 *buffer;
+	u64 slot, first, last, byte, len;
+	unsigned int i, j, k;
+	int device;
+	int res, ret = 0, devret;
+
+	buffer = kmalloc(PAGE_SIZE, GFP_NOFS);
+	if (!buffer)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i = j) {
+		device = blocks[i].device;
+		backdev = dev->backdev[device];
+		for (j = i; j < count && blocks[j].device == device; j++)
+			;
+		first = (blocks[i].offset - backdev->startofdata) >> BLK_SHIFT;
+		last = (blocks[j - 1].offset - backdev->startofdata) >>
+		       BLK_SHIFT;
+
+		mutex_lock(&backdev->bitlist_mutex);
+		k = i;
+		devret = 0;
+		for (byte = first >> 3; byte <= last >> 3; byte += len) {
+			len = min_t(u64, (last >> 3) + 1 - byte, PAGE_SIZE);
+			spin_lock(&backdev->dev_alloc_lock);
+			memcpy(buffer, (u8 *)backdev->bitlist + byte, len);
+			spin_unlock(&backdev->dev_alloc_lock);
+			for (; k < j; k++) {
+				slot = (blocks[k].offset -
+					backdev->startofdata) >>
+				       BLK_SHIFT;
+				if (slot >= (byte + len) << 3)
+					break;
+				__clear_bit_le(slot - (byte << 3), buffer);
+			}
+			res = tier_file_write(dev, device, buffer, len,
+					      backdev->startofbitlist + byte);
+			if (res)
+				devret = res;
+		}
+		res = tier_meta_sync(dev, device,
+				     backdev->startofbitlist + (first >> 3),
+				     backdev->startofbitlist + (last >> 3));
+		if (res)
+			devret = res;
+		if (devret) {
+			ret = devret;
+			mutex_unlock(&backdev->bitlist_mutex);
+			continue;
+		}
+
+		spin_lock(&backdev->dev_alloc_lock);
+		if (backdev->free_offset > first)
+			backdev->free_offset = first;
+		for (k = i; k < j; k++) {
+			slot = (blocks[k].offset - backdev->startofdata) >>
+			       BLK_SHIFT;
+			if (__test_and_clear_bit_le(slot, backdev->bitlist))
+				backdev->allocated_blocks--;
+		}
+		spin_unlock(&backdev->dev_alloc_lock);
+		mutex_unlock(&backdev->bitlist_mutex);
+	}
+
+	kfree(buffer);
+	return ret;
+}
+
+/* Number of slots of the bitlist of backdev that map to the data area */
+static u64 bitlist_slots(struct backing_device *backdev)
+{
+	return min(backdev->bitlistsize,
+		   (backdev->endofdata - backdev->startofdata) >> BLK_SHIFT);
+}
+
+/* Return true when slot of the bitlist of backdev can be allocated */
+static bool slot_is_free(struct backing_device *backdev, u64 slot)
+{
+	if (slot >= bitlist_slots(backdev))
+		return false;
+	return !test_bit_le(slot, backdev->bitlist);
+}
+
+/*
+ * The slot right behind the previous logical block, when that one is
+ * stored on device. Keeps logically adjacent blocks physically adjacent.
+ * Only a segment that is in memory is looked at, this must not sleep.
+ * Returns -1 when there is no such slot.
+ */
+static u64 alloc_goal(struct tier_device *dev, u64 blocknr, int device)
 {
 	struct backing_device *backdev = dev->backdev[device];
-	u8 *buffer = NULL;
-	u64 boffset, cur = 0;
-	u64 relative_offset = 0;
-	int ret = 0;
-	unsigned int buffercount;
-	u8 allocated = ALLOCATED;
+	struct blocklist_segment *segment;
+	struct blockinfo *prev;
+	u64 offset;
+
+	if (0 == blocknr)
+		return -1;
+	segment = smp_load_acquire(
+	    &dev->segments[(blocknr - 1) >> BLOCKLIST_SEGMENT_SHIFT]);
+	if (!segment)
+		return -1;
+
+	prev = &segment->binfo[(blocknr - 1) & (BLOCKLIST_SEGMENT_BLOCKS - 1)];
+	if (READ_ONCE(prev->device) != device + 1)
+		return -1;
+	offset = READ_ONCE(prev->offset);
+	if (offset < backdev->startofdata)
+		return -1;
+	return ((offset - backdev->startofdata) >> BLK_SHIFT) + 1;
+}
 
+/*
+ * Find the first run of run free slots, starting at free_offset.
+ * Returns -1 when there is none.
+ */
+static u64 find_free_run(struct backing_device *backdev, unsigned int run)
+{
+	unsigned long nslots = bitlist_slots(backdev);
+	unsigned long slot = backdev->free_offset;
+	unsigned long end;
+
+	while (slot < nslots) {
+		slot = find_next_zero_bit_le(backdev->bitlist, nslots, slot);
+		if (slot >= nslots)
+			break;
+		end = find_next_bit_le(backdev->bitlist, nslots, slot);
+		if (end - slot >= run)
+			return slot;
+		slot = end;
+	}
+	return -1;
+}
+
+/*
+ * Allocate a block on device for blocknr. The block goes right behind
+ * the previous logical block when possible, a sequential stream that
+ * can't do that starts in a free run, everything else takes the first
+ * free block.
+ */
+static int __allocate_dev(struct tier_device *dev, u64 blocknr,
+			  struct blockinfo *binfo, int device, int iotype,
+			  u64 goal)
+{
+	struct backing_device *backdev = dev->backdev[device];
+	bool released = false;
+	u64 slot;
+
+	/* looked up outside dev_alloc_lock, slot_is_free checks it again */
+	if (-1 == goal)
+		goal = alloc_goal(dev, blocknr, device);
+retry:
 	spin_lock(&backdev->dev_alloc_lock);
 
-	cur = backdev->free_offset >> PAGE_SHIFT;
-
-	/* The bitlist may be loaded into memory or be NULL if not */
-	while (0 == binfo->device && (cur * PAGE_SIZE) < backdev->bitlistsize) {
-		buffer = &backdev->bitlist[cur * PAGE_SIZE];
-		buffercount = 0;
-		while (0 == binfo->device) {
-			if (ALLOCATED != buffer[buffercount]) {
-				binfo->offset = (cur * PAGE_SIZE * BLKSIZE) +
-						(buffercount * BLKSIZE);
-				relative_offset = binfo->offset;
-				binfo->offset += backdev->startofdata;
-				if (binfo->offset + BLKSIZE >
-				    backdev->endofdata) {
-					goto end_exit;
-				} else {
-					backdev->free_offset =
-					    relative_offset >> BLK_SHIFT;
-					backdev->usedoffset = binfo->offset;
-					boffset = relative_offset >> BLK_SHIFT;
-					backdev->bitlist[boffset] = allocated;
-					spin_unlock(&backdev->dev_alloc_lock);
-
-					binfo->device = device + 1;
-					ret = mark_offset_as_used(
-					    dev, device, relative_offset);
-
-					return ret;
-				}
+	slot = goal;
+	if (-1 == slot || !slot_is_free(backdev, slot)) {
+		slot = -1;
+		if (SEQUENTIAL == iotype)
+			slot = find_free_run(backdev, TIER_ALLOC_RUN);
+		if (-1 == slot) {
+			slot = find_free_run(backdev, 1);
+			if (-1 == slot) {
+				spin_unlock(&backdev->dev_alloc_lock);
+				/* The shadows make way for new data */
+				if (released ||
+				    !atomic_read(&dev->shadowed_blocks))
+					return 0;
+				release_shadows(dev, device, false);
+				released = true;
+				goto retry;
 			}
-			buffercount++;
-			if (buffercount >= PAGE_SIZE)
-				break;
+			backdev->free_offset = slot;
 		}
-		cur++;
 	}
-end_exit:
+
+	binfo->offset = backdev->startofdata + (slot << BLK_SHIFT);
+	backdev->usedoffset = binfo->offset;
+	__set_bit_le(slot, backdev->bitlist);
+	backdev->allocated_blocks++;
 	spin_unlock(&backdev->dev_alloc_lock);
-	return ret;
+
+	binfo->device = device + 1;
+	return mark_offset_as_used(dev, device, slot << BLK_SHIFT);
 }
 
-static int tier_file_write(struct tier_device *dev, unsigned int device,
-			   void *buf, size_t len, loff_t pos)
+int allocate_dev(struct tier_device *dev, u64 blocknr, struct blockinfo *binfo,
+		 int device, int iotype)
+{
+	return __allocate_dev(dev, blocknr, binfo, device, iotype, -1);
+}
+
+/*
+ * Start of a run of count free blocks on device, or of a shorter run when
+ * there is none that long. Returns -1 when there is no free block at all.
+ */
+static u64 reserve_run(struct tier_device *dev, int device, unsigned int count)
+{
+	struct backing_device *backdev = dev->backdev[device];
+	u64 slot;
+
+	spin_lock(&backdev->dev_alloc_lock);
+	do {
+		slot = find_free_run(backdev, count);
+		count >>= 1;
+	} while (-1 == slot && count);
+	spin_unlock(&backdev->dev_alloc_lock);
+	return slot;
+}
+
+static int __tier_file_write(struct tier_device *dev, struct file *file,
+			     void *buf, size_t len, loff_t pos)
 {
 	ssize_t bw;
 	mm_segment_t old_fs = get_fs();
-	struct backing_device *backdev = dev->backdev[device];
 
 	set_fs(get_ds());
 	set_debug_info(dev, VFSWRITE);
-	bw = vfs_write(backdev->fds, buf, len, &pos);
+	bw = vfs_write(file, buf, len, &pos);
 	clear_debug_info(dev, VFSWRITE);
 
 	/*
@@ -337,25 +540,63 @@ static int tier_file_write(struct tier_device *dev, unsigned int device,
 	if (likely(bw == len))
 		return 0;
 	pr_err("Write error on device %s at offset %llu, length %llu\n",
-	       backdev->fds->f_path.dentry->d_name.name,
-	       (unsigned long long)pos, (unsigned long long)len);
+	       file->f_path.dentry->d_name.name, (unsigned long long)pos,
+	       (unsigned long long)len);
 	if (bw >= 0)
 		bw = -EIO;
 	return bw;
 }
 
+/*
+ * Metadata on persistent memory is stored with non temporal copies, the
+ * wmb_pmem makes it durable without a block write and fsync.
+ */
+static int tier_pmem_write(struct tier_device *dev, void *buf, size_t len,
+			   loff_t pos)
+{
+	if (pos + len > dev->metadev->pmem_size) {
+		pr_err("Write beyond the metadata device at offset %llu, "
+		       "length %llu\n",
+		       (unsigned long long)pos, (unsigned long long)len);
+		return -EIO;
+	}
+	memcpy_to_pmem(dev->metadev->pmem + pos, buf, len);
+	wmb_pmem();
+	return 0;
+}
+
+/* Write metadata of device, to the device itself or the metadata device */
+static int tier_file_write(struct tier_device *dev, unsigned int device,
+			   void *buf, size_t len, loff_t pos)
+{
+	if (dev->backdev[device]->pmem)
+		return tier_pmem_write(dev, buf, len, pos);
+	return __tier_file_write(dev, dev->backdev[device]->metafds, buf, len,
+				 pos);
+}
+
+/*
+ * Make the metadata of device between start and end durable. A write to
+ * persistent memory already is.
+ */
+static int tier_meta_sync(struct tier_device *dev, unsigned int device,
+			  loff_t start, loff_t end)
+{
+	if (dev->backdev[device]->pmem)
+		return 0;
+	return vfs_fsync_range(dev->backdev[device]->metafds, start, end,
+			       FSMODE);
+}
+
 /**
- * tier_file_read - helper for reading data
+ * __tier_file_read - helper for reading data
  */
-static int tier_file_read(struct tier_device *dev, unsigned int device,
-			  void *buf, const int len, loff_t pos)
+static int __tier_file_read(struct tier_device *dev, struct file *file,
+			    void *buf, const int len, loff_t pos)
 {
-	struct backing_device *backdev = dev->backdev[device];
-	struct file *file;
 	ssize_t bw;
 	mm_segment_t old_fs = get_fs();
 
-	file = backdev->fds;
 	set_debug_info(dev, VFSREAD);
 	set_fs(get_ds());
 	bw = vfs_read(file, buf, len, &pos);
@@ -370,6 +611,23 @@ static int tier_file_read(struct tier_device *dev, unsigned int device,
 	return bw;
 }
 
+static int tier_file_read(struct tier_device *dev, unsigned int device,
+			  void *buf, const int len, loff_t pos)
+{
+	if (dev->backdev[device]->pmem) {
+		if (pos + len > dev->metadev->pmem_size) {
+			pr_err("Read error on the metadata device at offset "
+			       "%llu, length %i.\n",
+			       (unsigned long long)pos, len);
+			return -EIO;
+		}
+		memcpy_from_pmem(buf, dev->metadev->pmem + pos, len);
+		return 0;
+	}
+	return __tier_file_read(dev, dev->backdev[device]->metafds, buf, len,
+				pos);
+}
+
 int tier_sync(struct tier_device *dev)
 {
 	int ret = 0;
@@ -383,6 +641,9 @@ int tier_sync(struct tier_device *dev)
 			dev->backdev[i]->dirty = 0;
 		}
 	}
+	/* the blocklist, bitlists and journals on the metadata device */
+	if (!ret && dev->metadev && !dev->metadev->pmem)
+		ret = vfs_fsync(dev->metadev->fds, 0);
 	clear_debug_info(dev, PRESYNC);
 	return ret;
 }
@@ -421,24 +682,6 @@ void tiererror(struct tier_device *dev, char *msg)
 	pr_crit("tiererror : %s\n", msg);
 }
 
-/* if a physical_blockinfo has same content as blockinfo */
-static bool same_blockinfo(struct physical_blockinfo *phy_binfo,
-			   struct blockinfo *binfo)
-{
-	if (phy_binfo->device != binfo->device)
-		return false;
-	if (phy_binfo->offset != binfo->offset)
-		return false;
-	if (phy_binfo->lastused != binfo->lastused)
-		return false;
-	if (phy_binfo->readcount != binfo->readcount)
-		return false;
-	if (phy_binfo->writecount != binfo->writecount)
-		return false;
-
-	return true;
-}
-
 /* copy blockinfo to physical_blockinfo */
 static void copy_blockinfo(struct physical_blockinfo *phy_binfo,
 			   struct blockinfo *binfo)
@@ -462,72 +705,210 @@ static void copy_physical_blockinfo(struct blockinfo *binfo,
 }
 
 /* Delayed metadata update routine */
-static void update_blocklist(struct tier_device *dev, u64 blocknr,
-			     struct blockinfo *binfo)
+int write_blocklist(struct tier_device *dev, u64 blocknr,
+		    struct blockinfo *binfo, int write_policy)
 {
-	struct physical_blockinfo *phy_binfo;
-	int res;
+	int ret = 0;
+	struct backing_device *backdev = dev->backdev[0];
+	u64 blocklist_offset = backdev->startofblocklist;
+	struct physical_blockinfo phy_binfo;
+	struct blockinfo *entry;
 
-	if (dev->inerror)
-		return;
+	binfo->lastused = get_seconds();
+	entry = blocklist_entry(dev, blocknr);
+	if (!entry)
+		return -EIO;
 
-	phy_binfo = kzalloc(sizeof(*phy_binfo), GFP_NOFS);
-	if (!phy_binfo) {
-		tiererror(dev, "kzalloc failed");
-		return;
+	if (write_policy == WC) {
+		memcpy(entry, binfo, sizeof(struct blockinfo));
+		mark_blockinfo_dirty(dev, blocknr);
+		return ret;
 	}
 
-	res = tier_file_read(dev, 0, phy_binfo, sizeof(*phy_binfo),
-			     dev->backdev[0]->startofblocklist +
-				 (blocknr * sizeof(*phy_binfo)));
-	if (res != 0)
-		tiererror(dev, "tier_file_read : returned an error");
+	/* Keep write_blocklist_range from writing a stale copy */
+	down_read(&dev->blocklist_lock);
+	if (write_policy != WD)
+		memcpy(entry, binfo, sizeof(struct blockinfo));
+
+	blocklist_offset += (blocknr * sizeof(struct physical_blockinfo));
+	copy_blockinfo(&phy_binfo, binfo);
 
-	if (!same_blockinfo(phy_binfo, binfo)) {
-		(void)write_blocklist(dev, blocknr, binfo, WD);
+	ret = tier_file_write(dev, 0, &phy_binfo, sizeof(phy_binfo),
+			      blocklist_offset);
+	if (ret != 0) {
+		pr_crit("write_blocklist failed to write blockinfo\n");
+		goto end_unlock;
 	}
+	ret = tier_meta_sync(dev, 0, blocklist_offset,
+			     blocklist_offset + sizeof(phy_binfo));
 
-	kfree(phy_binfo);
+end_unlock:
+	up_read(&dev->blocklist_lock);
+	return ret;
+}
+
+/* Number of segments of the blocklist and the entries of segment seg */
+static u64 blocklist_segments(struct tier_device *dev)
+{
+	return ((dev->size >> BLK_SHIFT) + BLOCKLIST_SEGMENT_BLOCKS - 1) >>
+	       BLOCKLIST_SEGMENT_SHIFT;
 }
 
-/* When write_blocklist is called with write_policy set to
- * WD(isk) the data is written to disk without updating the cache
- * WC(ache) only updates the cache. This is used for statistics only
- * since this data is not critical.
- * WA(ll) writes to all, cache and disk.
+static unsigned int segment_entries(struct tier_device *dev, u64 seg)
+{
+	return min_t(u64, (dev->size >> BLK_SHIFT) -
+			      (seg << BLOCKLIST_SEGMENT_SHIFT),
+		     BLOCKLIST_SEGMENT_BLOCKS);
+}
+
+/*
+ * Write count in memory blockinfo entries from blocknr on to disk, using
+ * buffer of one page. The entries lie in one loaded segment. The caller
+ * holds blocklist_lock for writing.
  */
-int write_blocklist(struct tier_device *dev, u64 blocknr,
-		    struct blockinfo *binfo, int write_policy)
+static int write_blocklist_pages(struct tier_device *dev, u64 blocknr,
+				 u64 count, struct physical_blockinfo *buffer)
 {
+	struct backing_device *backdev = dev->backdev[0];
+	struct blocklist_segment *segment =
+	    dev->segments[blocknr >> BLOCKLIST_SEGMENT_SHIFT];
+	unsigned int entry = blocknr & (BLOCKLIST_SEGMENT_BLOCKS - 1);
+	unsigned int perpage = PAGE_SIZE / sizeof(struct physical_blockinfo);
+	u64 offset, done;
+	unsigned int i, n;
 	int ret = 0;
+
+	offset = backdev->startofblocklist +
+		 (blocknr * sizeof(struct physical_blockinfo));
+	for (done = 0; done < count; done += n) {
+		n = min_t(u64, count - done, perpage);
+		for (i = 0; i < n; i++)
+			copy_blockinfo(&buffer[i],
+				       &segment->binfo[entry + done + i]);
+		ret = tier_file_write(dev, 0, buffer, n * sizeof(*buffer),
+				      offset);
+		if (ret != 0) {
+			pr_crit("write_blocklist_range failed to write "
+				"blocklist\n");
+			break;
+		}
+		offset += n * sizeof(*buffer);
+	}
+	return ret;
+}
+
+/*
+ * Write count in-memory blocklist entries starting at blocknr to disk
+ * with large sequential writes and a single fsync. Segments that were
+ * never loaded are unchanged and skipped.
+ */
+int write_blocklist_range(struct tier_device *dev, u64 blocknr, u64 count)
+{
 	struct backing_device *backdev = dev->backdev[0];
+	struct physical_blockinfo *buffer;
+	u64 start, end, n;
+	int ret = 0;
 
-	binfo->lastused = get_seconds();
+	if (!count)
+		return 0;
+
+	buffer = kmalloc(PAGE_SIZE, GFP_NOFS);
+	if (!buffer)
+		return -ENOMEM;
+
+	start = backdev->startofblocklist +
+		(blocknr * sizeof(struct physical_blockinfo));
+	end = start + count * sizeof(*buffer) - 1;
 
-	if (write_policy != WD) {
-		memcpy(backdev->blocklist[blocknr], binfo,
-		       sizeof(struct blockinfo));
+	down_write(&dev->blocklist_lock);
+	for (; count && !ret; blocknr += n, count -= n) {
+		n = min_t(u64, count,
+			  BLOCKLIST_SEGMENT_BLOCKS -
+			      (blocknr & (BLOCKLIST_SEGMENT_BLOCKS - 1)));
+		if (dev->segments[blocknr >> BLOCKLIST_SEGMENT_SHIFT])
+			ret = write_blocklist_pages(dev, blocknr, n, buffer);
 	}
+	if (0 == ret)
+		ret = tier_meta_sync(dev, 0, start, end);
+	up_write(&dev->blocklist_lock);
 
-	if (write_policy != WC) {
-		u64 blocklist_offset = backdev->startofblocklist;
-		struct physical_blockinfo phy_binfo;
+	kfree(buffer);
+	return ret;
+}
 
-		blocklist_offset +=
-		    (blocknr * sizeof(struct physical_blockinfo));
-		copy_blockinfo(&phy_binfo, binfo);
+/*
+ * Write the dirty entries of segment seg, a page of entries at a time.
+ * first and last are widened to the range that was written.
+ */
+static int flush_segment(struct tier_device *dev, u64 seg,
+			 struct physical_blockinfo *buffer, u64 *first,
+			 u64 *last)
+{
+	struct blocklist_segment *segment = dev->segments[seg];
+	unsigned int perpage = PAGE_SIZE / sizeof(struct physical_blockinfo);
+	unsigned int entries = segment_entries(dev, seg);
+	u64 base = seg << BLOCKLIST_SEGMENT_SHIFT;
+	unsigned long entry, next, end;
+	int ret = 0;
 
-		ret = tier_file_write(dev, 0, &phy_binfo, sizeof(phy_binfo),
-				      blocklist_offset);
-		if (ret != 0) {
-			pr_crit("write_blocklist failed to write blockinfo\n");
-			return ret;
+	entry = find_first_bit(segment->dirty, entries);
+	while (entry < entries) {
+		/* all dirty entries that fit in one page with entry */
+		end = entry + 1;
+		next = find_next_bit(segment->dirty, entries, end);
+		while (next < entries && next < entry + perpage) {
+			end = next + 1;
+			next = find_next_bit(segment->dirty, entries, end);
 		}
-		ret = vfs_fsync_range(backdev->fds, blocklist_offset,
-				      blocklist_offset + sizeof(phy_binfo),
-				      FSMODE);
+		bitmap_clear(segment->dirty, entry, end - entry);
+		ret = write_blocklist_pages(dev, base + entry, end - entry,
+					    buffer);
+		if (ret)
+			break;
+		if (*first > base + entry)
+			*first = base + entry;
+		*last = base + end;
+		entry = next;
 	}
+	return ret;
+}
 
+/*
+ * Write back the blockinfo entries that were only changed in memory,
+ * a page of entries at a time, followed by a single flush.
+ */
+int flush_blocklist(struct tier_device *dev)
+{
+	struct backing_device *backdev = dev->backdev[0];
+	u64 segments = blocklist_segments(dev);
+	struct physical_blockinfo *buffer;
+	u64 first = dev->size >> BLK_SHIFT, last = 0;
+	u64 seg;
+	int ret = 0;
+
+	if (!dev->dirty_segments || dev->inerror)
+		return 0;
+
+	buffer = kmalloc(PAGE_SIZE, GFP_NOFS);
+	if (!buffer)
+		return -ENOMEM;
+
+	down_write(&dev->blocklist_lock);
+	for (seg = find_first_bit(dev->dirty_segments, segments);
+	     seg < segments;
+	     seg = find_next_bit(dev->dirty_segments, segments, seg + 1)) {
+		clear_bit(seg, dev->dirty_segments);
+		ret = flush_segment(dev, seg, buffer, &first, &last);
+		if (ret)
+			break;
+	}
+	if (0 == ret && last)
+		ret = tier_meta_sync(
+		    dev, 0, backdev->startofblocklist + first * sizeof(*buffer),
+		    backdev->startofblocklist + last * sizeof(*buffer) - 1);
+	up_write(&dev->blocklist_lock);
+
+	kfree(buffer);
 	return ret;
 }
 
@@ -552,7 +933,10 @@ static void write_blocklist_journal(struct tier_device *dev, u64 blocknr,
 
 	olddev_magic->blocknr_journal = blocknr;
 	tier_file_write(dev, olddevice->device - 1, oldbackdev->devmagic,
-			sizeof(struct devicemagic), 0);
+			sizeof(struct devicemagic), oldbackdev->journal_offset);
+	tier_meta_sync(dev, olddevice->device - 1, oldbackdev->journal_offset,
+		       oldbackdev->journal_offset +
+			   sizeof(struct devicemagic) - 1);
 	sync_device(dev, olddevice->device - 1);
 }
 
@@ -565,7 +949,11 @@ static void clean_blocklist_journal(struct tier_device *dev, int device)
 	memset(&devmagic->binfo_journal_new, 0,
 	       sizeof(struct physical_blockinfo));
 	devmagic->blocknr_journal = 0;
-	tier_file_write(dev, device, devmagic, sizeof(*devmagic), 0);
+	tier_file_write(dev, device, devmagic, sizeof(*devmagic),
+			dev->backdev[device]->journal_offset);
+	tier_meta_sync(dev, device, dev->backdev[device]->journal_offset,
+		       dev->backdev[device]->journal_offset +
+			   sizeof(*devmagic) - 1);
 	sync_device(dev, device);
 }
 
@@ -574,9 +962,21 @@ static void recover_journal(struct tier_device *dev, int device)
 	u64 blocknr;
 	struct backing_device *backdev = dev->backdev[device];
 	struct devicemagic *devmagic = backdev->devmagic;
+	struct devicemagic *journal;
 	struct blockinfo binfo;
 
-	tier_file_read(dev, device, devmagic, sizeof(*devmagic), 0);
+	/* Only take the journal, the rest of a journal slot can be stale */
+	journal = kmalloc(sizeof(*journal), GFP_KERNEL);
+	if (!journal) {
+		tiererror(dev, "recover_journal : alloc failed");
+		return;
+	}
+	tier_file_read(dev, device, journal, sizeof(*journal),
+		       backdev->journal_offset);
+	devmagic->blocknr_journal = journal->blocknr_journal;
+	devmagic->binfo_journal_old = journal->binfo_journal_old;
+	devmagic->binfo_journal_new = journal->binfo_journal_new;
+	kfree(journal);
 	if (0 == devmagic->binfo_journal_old.device) {
 		pr_info(
 		    "recover_journal : journal is clean, no need to recover\n");
@@ -691,6 +1091,30 @@ void reset_counters_on_migration(struct tier_device *dev,
 	return;
 }
 
+/*
+ * Copy the data of curblock from olddevice to the already allocated
+ * newdevice and switch the blocklist over, protected by the journal.
+ * Returns 1 when the block was moved.
+ */
+static int move_block(struct tier_device *dev, struct blockinfo *newdevice,
+		      struct blockinfo *olddevice, u64 curblock)
+{
+	int res;
+
+	/* the actual data moving */
+	res = tier_moving_block(dev, olddevice, newdevice);
+	if (res != 0) {
+		pr_err("copyblock: read failed, cancelling operation\n");
+		return 0;
+	}
+
+	write_blocklist_journal(dev, curblock, newdevice, olddevice);
+	write_blocklist(dev, curblock, newdevice, WA);
+	sync_device(dev, newdevice->device - 1);
+	clean_blocklist_journal(dev, olddevice->device - 1);
+	return 1;
+}
+
 /* When a block is migrated to a different tier
  * the readcount and writecount are reset to 0.
  * The block now has hit_collecttime seconds to
@@ -709,7 +1133,7 @@ void reset_counters_on_migration(struct tier_device *dev,
  * are often re-written on SLC SSD.
  */
 static int copyblock(struct tier_device *dev, struct blockinfo *newdevice,
-		     struct blockinfo *olddevice, u64 curblock)
+		     struct blockinfo *olddevice, u64 curblock, u64 slot)
 {
 	int devicenr = newdevice->device - 1;
 	int res = 0;
@@ -731,49 +1155,178 @@ static int copyblock(struct tier_device *dev, struct blockinfo *newdevice,
 		return 0;
 	}
 
-	allocate_dev(dev, curblock, newdevice, devicenr);
+	__allocate_dev(dev, curblock, newdevice, devicenr, RANDOM, slot);
 
 	/* No space on the device to copy to is not an error */
 	if (0 == newdevice->device)
 		return 0;
 
-	/* the actual data moving */
-	res = tier_moving_block(dev, olddevice, newdevice);
-	if (res != 0)
-		goto end_error;
-
-	write_blocklist_journal(dev, curblock, newdevice, olddevice);
-	write_blocklist(dev, curblock, newdevice, WA);
-	sync_device(dev, newdevice->device - 1);
-	clean_blocklist_journal(dev, olddevice->device - 1);
-
-	if (dev->migrate_verbose)
+	res = move_block(dev, newdevice, olddevice, curblock);
+	if (res && dev->migrate_verbose)
 		pr_info("migrated blocknr %llu from device %u-%llu to device "
 			"%u-%llu\n",
 			curblock, olddevice->device - 1, olddevice->offset,
 			newdevice->device - 1, newdevice->offset);
-	return 1;
+	return res;
+}
 
-end_error:
-	pr_err("copyblock: read failed, cancelling operation\n");
-	return 0;
+/*
+ * A promoted block keeps its copy on the lower tier as a shadow until
+ * the block is written or the lower tier runs out of space, so that
+ * demoting it again only has to switch the blocklist entry back.
+ * Shadows are kept in dev->shadow_tree, indexed by blocknr, as the
+ * freed_block that they turn into once released. A write only tags the
+ * shadow stale, the data migrator releases stale shadows.
+ * Shadows are not persistent. Their blocks stay allocated in the bitlist
+ * and are released on deregister, after a crash repair_bitlists frees
+ * them.
+ */
+void shadow_stale(struct tier_device *dev, u64 blocknr)
+{
+	if (!atomic_read(&dev->shadowed_blocks))
+		return;
+	spin_lock(&dev->shadow_lock);
+	if (radix_tree_lookup(&dev->shadow_tree, blocknr))
+		radix_tree_tag_set(&dev->shadow_tree, blocknr, SHADOW_STALE);
+	spin_unlock(&dev->shadow_lock);
 }
 
-static int migrate_up_ifneeded(struct tier_device *dev, struct blockinfo *binfo,
-			       u64 curblock)
+/* Remove the shadow of blocknr from the tree, NULL when there is none */
+static struct freed_block *take_shadow(struct tier_device *dev, u64 blocknr,
+				       bool *stale)
 {
-	int res = 0;
-	struct blockinfo *orgbinfo;
-	u64 hitcount = 0;
-	u64 avghitcount = 0;
-	u64 avghitcountnexttier = 0;
-	u64 hysteresis;
-	struct devicemagic *dmagic;
+	struct freed_block *shadow;
 
-	if (!binfo)
-		return res;
-	if (binfo->device <= 1) /* already on tier0 */
-		return res;
+	if (!atomic_read(&dev->shadowed_blocks))
+		return NULL;
+	spin_lock(&dev->shadow_lock);
+	*stale = radix_tree_tag_get(&dev->shadow_tree, blocknr, SHADOW_STALE);
+	shadow = radix_tree_delete(&dev->shadow_tree, blocknr);
+	spin_unlock(&dev->shadow_lock);
+	if (shadow)
+		atomic_dec(&dev->shadowed_blocks);
+	return shadow;
+}
+
+/* Keep the old location orgbinfo of the promoted blocknr as its shadow */
+static void keep_shadow(struct tier_device *dev, u64 blocknr,
+			struct blockinfo *orgbinfo)
+{
+	struct freed_block *shadow;
+	int ret = -ENOMEM;
+
+	shadow = kmalloc(sizeof(*shadow), GFP_NOFS);
+	if (shadow && !radix_tree_preload(GFP_NOFS)) {
+		shadow->device = orgbinfo->device - 1;
+		shadow->offset = orgbinfo->offset;
+		spin_lock(&dev->shadow_lock);
+		ret = radix_tree_insert(&dev->shadow_tree, blocknr, shadow);
+		spin_unlock(&dev->shadow_lock);
+		radix_tree_preload_end();
+	}
+	if (ret) {
+		kfree(shadow);
+		clear_dev_list(dev, orgbinfo);
+		discard_on_real_device(dev, orgbinfo);
+		return;
+	}
+	atomic_inc(&dev->shadowed_blocks);
+}
+
+/*
+ * Release the shadows on device, or on all devices when device is -1.
+ * With stale set only the stale shadows are released. The tree is looked
+ * up in batches and the entries are only deleted afterwards, a delete may
+ * free the node that an iterator is on.
+ */
+static void release_shadows(struct tier_device *dev, int device, bool stale)
+{
+	unsigned int max = PAGE_SIZE / sizeof(struct freed_block);
+	void **slots[TIER_TREE_GANG];
+	unsigned long indices[TIER_TREE_GANG];
+	struct freed_block *shadows[TIER_TREE_GANG];
+	struct freed_block *blocks, *shadow;
+	unsigned long next = 0;
+	unsigned int count, found, i;
+
+	if (!atomic_read(&dev->shadowed_blocks))
+		return;
+	blocks = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!blocks)
+		return;
+
+	do {
+		count = 0;
+		spin_lock(&dev->shadow_lock);
+		do {
+			found = radix_tree_gang_lookup_slot(
+			    &dev->shadow_tree, slots, indices, next,
+			    min_t(unsigned int, TIER_TREE_GANG, max - count));
+			for (i = 0; i < found; i++)
+				shadows[i] = radix_tree_deref_slot(slots[i]);
+			for (i = 0; i < found; i++) {
+				next = indices[i] + 1;
+				shadow = shadows[i];
+				if (-1 != device && shadow->device != device)
+					continue;
+				if (stale &&
+				    !radix_tree_tag_get(&dev->shadow_tree,
+							indices[i],
+							SHADOW_STALE))
+					continue;
+				radix_tree_delete(&dev->shadow_tree,
+						  indices[i]);
+				blocks[count++] = *shadow;
+				kfree(shadow);
+			}
+		} while (found && count < max);
+		spin_unlock(&dev->shadow_lock);
+		atomic_sub(count, &dev->shadowed_blocks);
+
+		sort(blocks, count, sizeof(*blocks), cmp_freed_block, NULL);
+		if (count && clear_dev_list_batch(dev, blocks, count))
+			pr_err("release_shadows : failed to update bitlist\n");
+	} while (count == max);
+
+	kfree(blocks);
+}
+
+/*
+ * Demote curblock by switching it back to its shadow, which still holds
+ * the same data. Nothing is copied.
+ */
+static int demote_to_shadow(struct tier_device *dev, struct blockinfo *binfo,
+			    struct blockinfo *orgbinfo, u64 curblock,
+			    struct freed_block *shadow)
+{
+	binfo->device = shadow->device + 1;
+	binfo->offset = shadow->offset;
+	binfo->readcount = 0;
+	binfo->writecount = 0;
+	binfo->lastused = get_seconds();
+
+	write_blocklist_journal(dev, curblock, binfo, orgbinfo);
+	write_blocklist(dev, curblock, binfo, WA);
+	sync_device(dev, binfo->device - 1);
+	clean_blocklist_journal(dev, orgbinfo->device - 1);
+	if (dev->migrate_verbose)
+		pr_info("demoted blocknr %llu to its shadow on device "
+			"%u-%llu\n",
+			curblock, binfo->device - 1, binfo->offset);
+	return 1;
+}
+
+/*
+ * Move curblock to newdevice, in slot when that is free. Returns 1 when
+ * the block was moved.
+ */
+static int migrate_block(struct tier_device *dev, struct blockinfo *binfo,
+			 u64 curblock, unsigned int newdevice, u64 slot)
+{
+	struct blockinfo *orgbinfo;
+	struct freed_block *shadow;
+	bool stale = false;
+	int res;
 
 	orgbinfo = kzalloc(sizeof(struct blockinfo), GFP_NOFS);
 	if (!orgbinfo) {
@@ -782,92 +1335,281 @@ static int migrate_up_ifneeded(struct tier_device *dev, struct blockinfo *binfo,
 	}
 	memcpy(orgbinfo, binfo, sizeof(struct blockinfo));
 
-	hitcount = binfo->readcount + binfo->writecount;
-	dmagic = dev->backdev[binfo->device - 1]->devmagic;
-	avghitcount = dmagic->average_reads + dmagic->average_writes;
-	if (hitcount >
-	    avghitcount + (btier_div(avghitcount, dev->attached_devices))) {
-		if (binfo->device > 1) {
-			dmagic = dev->backdev[binfo->device - 2]->devmagic;
-			avghitcountnexttier =
-			    dmagic->average_reads + dmagic->average_writes;
-			/* Hard coded hysteresis, maybe change this later
-			 * so that it can be adjusted via sysfs
-			 * Migrate up when the chunk is used more frequently
-			 * then
-			 * the chunks of the higher tier - hysteresis
-			 */
-			hysteresis = btier_div(avghitcountnexttier,
-					       dev->attached_devices);
-			if (hitcount > avghitcountnexttier - hysteresis)
-				binfo->device--;
+	shadow = take_shadow(dev, curblock, &stale);
+	if (shadow && !stale &&
+	    dev->backdev[shadow->device]->level ==
+		dev->backdev[newdevice - 1]->level) {
+		res = demote_to_shadow(dev, binfo, orgbinfo, curblock, shadow);
+		kfree(shadow);
+	} else {
+		if (shadow) {
+			if (clear_dev_list_batch(dev, shadow, 1))
+				pr_err("migrate_block : failed to release "
+				       "shadow\n");
+			kfree(shadow);
 		}
+		binfo->device = newdevice;
+		res = copyblock(dev, binfo, orgbinfo, curblock, slot);
 	}
-	if (orgbinfo->device != binfo->device) {
-		res = copyblock(dev, binfo, orgbinfo, curblock);
-		if (res) {
-			reset_counters_on_migration(dev, orgbinfo);
+	if (res) {
+		reset_counters_on_migration(dev, orgbinfo);
+		if (newdevice < orgbinfo->device) {
+			keep_shadow(dev, curblock, orgbinfo);
+		} else {
 			clear_dev_list(dev, orgbinfo);
 			discard_on_real_device(dev, orgbinfo);
-		} else {
-			/* copyblock failed, restore the old settings */
-			memcpy(binfo, orgbinfo, sizeof(struct blockinfo));
 		}
+	} else {
+		/* copyblock failed, restore the old settings */
+		memcpy(binfo, orgbinfo, sizeof(struct blockinfo));
 	}
 	kfree(orgbinfo);
 	return res;
 }
 
-static int migrate_down_ifneeded(struct tier_device *dev,
-				 struct blockinfo *binfo, u64 curblock)
+/*
+ * The device of tier level that blocknr is striped to. The members of a
+ * tier group take turns per TIER_ALLOC_RUN logical blocks, so that runs
+ * stay together while a stream is spread over all members.
+ */
+int group_member(struct tier_device *dev, unsigned int level, u64 blocknr)
+{
+	struct tier_level *tl = &dev->level[level];
+	u32 member;
+
+	div_u64_rem(div_u64(blocknr, TIER_ALLOC_RUN), tl->members, &member);
+	return tl->first + member;
+}
+
+/* The device of tier level with the most free blocks */
+static int emptiest_member(struct tier_device *dev, unsigned int level)
+{
+	struct tier_level *tl = &dev->level[level];
+	struct backing_device *backdev;
+	u64 free, most = 0;
+	int device = tl->first;
+	unsigned int i;
+
+	for (i = tl->first; i < tl->first + tl->members; i++) {
+		backdev = dev->backdev[i];
+		spin_lock(&backdev->dev_alloc_lock);
+		free = bitlist_slots(backdev) - backdev->allocated_blocks;
+		spin_unlock(&backdev->dev_alloc_lock);
+		if (free > most) {
+			most = free;
+			device = i;
+		}
+	}
+	return device;
+}
+
+/* Average hits of the blocks on the devices of tier level */
+static u64 level_hits(struct tier_device *dev, unsigned int level)
+{
+	struct tier_level *tl = &dev->level[level];
+	struct devicemagic *dmagic;
+	u64 hits = 0;
+	unsigned int i;
+
+	for (i = tl->first; i < tl->first + tl->members; i++) {
+		dmagic = dev->backdev[i]->devmagic;
+		hits += dmagic->average_reads + dmagic->average_writes;
+	}
+	return btier_div(hits, tl->members);
+}
+
+/* The device a block that is used often should move up to */
+static unsigned int migrate_up_target(struct tier_device *dev,
+				      struct blockinfo *binfo)
 {
-	int res = 0;
-	time_t curseconds = get_seconds();
-	struct blockinfo *orgbinfo;
 	u64 hitcount = 0;
 	u64 avghitcount = 0;
+	u64 avghitcountnexttier = 0;
 	u64 hysteresis;
-	struct backing_device *backdev = dev->backdev[binfo->device - 1];
-	struct devicemagic *dmagic = backdev->devmagic;
+	unsigned int level = dev->backdev[binfo->device - 1]->level;
 
-	if (binfo->device == 0)
-		return res;
+	if (0 == level) /* already on tier0 */
+		return binfo->device;
 
-	orgbinfo = kzalloc(sizeof(struct blockinfo), GFP_NOFS);
-	if (!orgbinfo) {
-		tiererror(dev, "alloc failed");
-		return -ENOMEM;
+	hitcount = binfo->readcount + binfo->writecount;
+	avghitcount = level_hits(dev, level);
+	if (hitcount >
+	    avghitcount + (btier_div(avghitcount, dev->attached_devices))) {
+		avghitcountnexttier = level_hits(dev, level - 1);
+		/* Hard coded hysteresis, maybe change this later
+		 * so that it can be adjusted via sysfs
+		 * Migrate up when the chunk is used more frequently
+		 * then
+		 * the chunks of the higher tier - hysteresis
+		 */
+		hysteresis =
+		    btier_div(avghitcountnexttier, dev->attached_devices);
+		if (hitcount > avghitcountnexttier - hysteresis)
+			return emptiest_member(dev, level - 1) + 1;
 	}
-	memcpy(orgbinfo, binfo, sizeof(struct blockinfo));
+	return binfo->device;
+}
+
+/* The device a block that is hardly used should move down to */
+static unsigned int migrate_down_target(struct tier_device *dev,
+					struct blockinfo *binfo)
+{
+	time_t curseconds = get_seconds();
+	u64 hitcount = 0;
+	u64 avghitcount = 0;
+	u64 hysteresis;
+	struct backing_device *backdev = dev->backdev[binfo->device - 1];
+	unsigned int level = backdev->level;
 
 	hitcount = binfo->readcount + binfo->writecount;
-	avghitcount = dmagic->average_reads + dmagic->average_writes;
+	avghitcount = level_hits(dev, level);
 	/* Check if the block has been unused long enough that it may
 	 * be moved to a lower tier
 	 */
 	hysteresis = btier_div(avghitcount, dev->attached_devices);
 	if (curseconds - binfo->lastused > backdev->devmagic->dtapolicy.max_age)
-		binfo->device++;
+		level++;
 	else if (hitcount < avghitcount - hysteresis &&
 		 curseconds - binfo->lastused >
 		     backdev->devmagic->dtapolicy.hit_collecttime)
-		if (binfo->device < dev->attached_devices - 1)
-			binfo->device++;
-	if (binfo->device > dev->attached_devices) {
-		binfo->device = orgbinfo->device;
-	} else if (orgbinfo->device != binfo->device) {
-		res = copyblock(dev, binfo, orgbinfo, curblock);
-		if (res) {
-			reset_counters_on_migration(dev, orgbinfo);
-			clear_dev_list(dev, orgbinfo);
-			discard_on_real_device(dev, orgbinfo);
-		} else {
-			/* copyblock failed, restore the old settings */
-			memcpy(binfo, orgbinfo, sizeof(struct blockinfo));
+		if (level + 1 < dev->levels - 1)
+			level++;
+	if (level >= dev->levels || level == backdev->level)
+		return binfo->device;
+	return emptiest_member(dev, level) + 1;
+}
+
+/*
+ * The device that a block which is about to be overwritten as a whole is
+ * better stored on, or 0 when it stays where it is. Such a write promotes
+ * the block without the copy that migration would need.
+ */
+unsigned int overwrite_target(struct tier_device *dev,
+			      struct blockinfo *binfo)
+{
+	struct data_policy *dtapolicy = &dev->backdev[0]->devmagic->dtapolicy;
+	unsigned int newdevice;
+
+	if (0 == binfo->device || dtapolicy->migration_disabled)
+		return 0;
+	newdevice = migrate_up_target(dev, binfo);
+	return newdevice == binfo->device ? 0 : newdevice;
+}
+
+/*
+ * Switch blocknr over to newbinfo, a block on another device that all of
+ * the data of blocknr has already been written to. The caller holds the
+ * block lock. The blocklist entry is the switch, a crash leaves either
+ * location in the blocklist and repair_bitlists releases the other one.
+ * The old block is only released once the switch is on disk. Returns 1
+ * when the block was moved, else newbinfo is released again.
+ */
+int redirect_block(struct tier_device *dev, u64 blocknr,
+		   struct blockinfo *binfo, struct blockinfo *newbinfo)
+{
+	struct blockinfo orgbinfo = *binfo;
+	int ret;
+
+	binfo_write_begin(binfo);
+	binfo->device = newbinfo->device;
+	binfo->offset = newbinfo->offset;
+	binfo->readcount = 0;
+	binfo->writecount = 0;
+	ret = write_blocklist(dev, blocknr, binfo, WA);
+	if (0 != ret) {
+		binfo->device = orgbinfo.device;
+		binfo->offset = orgbinfo.offset;
+		binfo->lastused = orgbinfo.lastused;
+		binfo->readcount = orgbinfo.readcount;
+		binfo->writecount = orgbinfo.writecount;
+	}
+	binfo_write_end(binfo);
+	if (0 != ret) {
+		clear_dev_list(dev, newbinfo);
+		return 0;
+	}
+
+	reset_counters_on_migration(dev, &orgbinfo);
+	clear_dev_list(dev, &orgbinfo);
+	discard_on_real_device(dev, &orgbinfo);
+	if (dev->migrate_verbose)
+		pr_info("redirected overwrite of blocknr %llu from device "
+			"%u-%llu to device %u-%llu\n",
+			blocknr, orgbinfo.device - 1, orgbinfo.offset,
+			binfo->device - 1, binfo->offset);
+	return 1;
+}
+
+static int cmp_migrate_candidate(const void *a, const void *b)
+{
+	const struct migrate_candidate *x = a, *y = b;
+
+	if (x->device != y->device)
+		return x->device < y->device ? -1 : 1;
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Migrate a batch of blocks. The blocks are read in the order in which
+ * they are stored on their devices, and written to runs of free blocks
+ * on their new devices, so that both sides see mostly sequential io.
+ * Normal io stops the batch after the block in progress, *resume is then
+ * the lowest blocknr that was not handled, else it is -1.
+ * Returns the number of blocks that were moved.
+ */
+static int migrate_batch(struct tier_device *dev,
+			 struct migrate_candidate *batch, unsigned int count,
+			 u64 *resume)
+{
+	u64 next[BTIER_MAX_DEVS];
+	unsigned int todo[BTIER_MAX_DEVS];
+	struct blockinfo *binfo;
+	unsigned int i, j, target;
+	int moved = 0;
+	int res;
+
+	*resume = -1;
+	sort(batch, count, sizeof(*batch), cmp_migrate_candidate, NULL);
+
+	memset(todo, 0, sizeof(todo));
+	for (i = 0; i < count; i++) {
+		todo[batch[i].newdevice - 1]++;
+		next[batch[i].newdevice - 1] = -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* the first block is always moved, so that the walk advances */
+		if (i && NORMAL_IO == atomic_read(&dev->wqlock)) {
+			for (j = i; j < count; j++)
+				*resume = min(*resume, batch[j].blocknr);
+			if (dev->migrate_verbose)
+				pr_info("migrate_batch interrupted by normal "
+					"io\n");
+			break;
 		}
+		target = batch[i].newdevice - 1;
+		if (-1 == next[target])
+			next[target] = reserve_run(dev, target, todo[target]);
+
+		binfo = get_blockinfo(dev, batch[i].blocknr, 0);
+		if (!binfo)
+			break;
+		res = migrate_block(dev, binfo, batch[i].blocknr,
+				    batch[i].newdevice, next[target]);
+		if (res < 0)
+			break;
+		todo[target]--;
+		if (res && -1 != next[target] &&
+		    binfo->offset == dev->backdev[target]->startofdata +
+					 (next[target] << BLK_SHIFT))
+			next[target]++;
+		else
+			next[target] = -1;
+		moved += res;
 	}
-	kfree(orgbinfo);
-	return res;
+	return moved;
 }
 
 int migrate_direct(struct tier_device *dev, u64 blocknr, int device)
@@ -891,7 +1633,8 @@ int load_bitlists(struct tier_device *dev)
 
 	for (device = 0; device < dev->attached_devices; device++) {
 		backdev = dev->backdev[device];
-		backdev->bitlist = vzalloc(backdev->bitlistsize);
+		backdev->bitlist =
+		    vzalloc(TIER_BITLIST_BYTES(backdev->bitlistsize));
 		if (!backdev->bitlist) {
 			pr_info("Failed to allocate memory to load bitlist %u "
 				"in memory\n",
@@ -899,8 +1642,9 @@ int load_bitlists(struct tier_device *dev)
 			res = -ENOMEM;
 			break;
 		}
-		for (cur = 0; cur < backdev->bitlistsize; cur += PAGE_SIZE) {
-			tier_file_read(dev, device, &backdev->bitlist[cur],
+		for (cur = 0; cur < TIER_BITLIST_BYTES(backdev->bitlistsize);
+		     cur += PAGE_SIZE) {
+			tier_file_read(dev, device, (u8 *)backdev->bitlist + cur,
 				       PAGE_SIZE,
 				       backdev->startofbitlist + cur);
 		}
@@ -920,80 +1664,526 @@ void free_bitlists(struct tier_device *dev)
 	}
 }
 
-static int load_blocklist(struct tier_device *dev)
+/*
+ * Allocate a segment, also from the io path, so that reclaim can not
+ * recurse into the block layer. A failure only fails the access that
+ * needed the segment, the device stays usable.
+ */
+static struct blocklist_segment *alloc_segment(struct tier_device *dev)
+{
+	struct blocklist_segment *segment;
+	unsigned int noio;
+
+	noio = memalloc_noio_save();
+	segment = vzalloc(sizeof(*segment));
+	memalloc_noio_restore(noio);
+	if (!segment)
+		pr_warn_ratelimited("alloc_segment : alloc failed\n");
+	return segment;
+}
+
+/*
+ * Read segment seg of the blocklist from disk, *used tells if it holds
+ * an allocated block. Returns NULL when it can't be read.
+ */
+static struct blocklist_segment *read_segment(struct tier_device *dev,
+					      u64 seg, bool *used)
+{
+	unsigned int perpage = PAGE_SIZE / sizeof(struct physical_blockinfo);
+	unsigned int entries = segment_entries(dev, seg);
+	u64 offset = dev->backdev[0]->startofblocklist +
+		     (seg << BLOCKLIST_SEGMENT_SHIFT) *
+			 sizeof(struct physical_blockinfo);
+	struct physical_blockinfo *buffer;
+	struct blocklist_segment *segment;
+	unsigned int done, i, n;
+	int res = 0;
+
+	*used = false;
+	segment = alloc_segment(dev);
+	if (!segment)
+		return NULL;
+	buffer = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!buffer) {
+		pr_warn_ratelimited("read_segment : alloc failed\n");
+		vfree(segment);
+		return NULL;
+	}
+	for (done = 0; done < entries && !res; done += n) {
+		n = min(entries - done, perpage);
+		res = tier_file_read(dev, 0, buffer, n * sizeof(*buffer),
+				     offset + done * sizeof(*buffer));
+		for (i = 0; i < n && !res; i++) {
+			copy_physical_blockinfo(&segment->binfo[done + i],
+						&buffer[i]);
+			if (buffer[i].device)
+				*used = true;
+		}
+	}
+	kfree(buffer);
+	if (res) {
+		tiererror(dev, "tier_file_read : returned an error");
+		vfree(segment);
+		return NULL;
+	}
+	return segment;
+}
+
+/* Make segment resident, unless another thread has loaded it already */
+static struct blocklist_segment *
+publish_segment(struct tier_device *dev, u64 seg,
+		struct blocklist_segment *segment)
+{
+	struct blocklist_segment *old;
+
+	old = cmpxchg(&dev->segments[seg], NULL, segment);
+	if (old) {
+		vfree(segment);
+		return old;
+	}
+	atomic64_add(sizeof(*segment), &dev->blocklist_memory);
+	return segment;
+}
+
+static size_t extents_size(unsigned int count)
+{
+	return sizeof(struct blocklist_extents) +
+	       count * sizeof(struct blocklist_extent);
+}
+
+/*
+ * Build the extent form of the entries in binfo. Returns NULL when the
+ * segment holds no block, when it is too fragmented or when a lastused
+ * does not fit in a struct block_heat, the segment is then kept as it is.
+ */
+static struct blocklist_extents *compact_segment(struct blockinfo *binfo,
+						 unsigned int entries)
+{
+	struct blocklist_extents *ext;
+	struct blocklist_extent *cur = NULL;
+	unsigned int count = 0;
+	unsigned int noio;
+	unsigned int i;
+
+	for (i = 0; i < entries; i++) {
+		if (binfo[i].lastused < 0 || binfo[i].lastused > U32_MAX)
+			return NULL;
+		if (!binfo[i].device)
+			continue;
+		if (!i || binfo[i - 1].device != binfo[i].device ||
+		    binfo[i - 1].offset + BLKSIZE != binfo[i].offset)
+			count++;
+	}
+	if (!count || count > BLOCKLIST_MAX_EXTENTS)
+		return NULL;
+
+	noio = memalloc_noio_save();
+	ext = vzalloc(extents_size(count));
+	memalloc_noio_restore(noio);
+	if (!ext)
+		return NULL;
+	for (i = 0; i < entries; i++) {
+		ext->heat[i].lastused = binfo[i].lastused;
+		ext->heat[i].readcount = binfo[i].readcount;
+		ext->heat[i].writecount = binfo[i].writecount;
+		if (!binfo[i].device) {
+			cur = NULL;
+			continue;
+		}
+		if (cur && cur->device == binfo[i].device &&
+		    cur->offset + (u64)cur->blocks * BLKSIZE ==
+			binfo[i].offset) {
+			cur->blocks++;
+			continue;
+		}
+		cur = &ext->extent[ext->count++];
+		cur->first = i;
+		cur->blocks = 1;
+		cur->device = binfo[i].device;
+		cur->offset = binfo[i].offset;
+	}
+	return ext;
+}
+
+/* Decode entry of a segment that is kept as extents into binfo */
+static void extents_entry(struct blocklist_extents *ext, unsigned int entry,
+			  struct blockinfo *binfo)
+{
+	struct blocklist_extent *extent;
+	unsigned int lo = 0, hi = ext->count, mid;
+
+	memset(binfo, 0, sizeof(*binfo));
+	binfo->lastused = ext->heat[entry].lastused;
+	binfo->readcount = ext->heat[entry].readcount;
+	binfo->writecount = ext->heat[entry].writecount;
+	/* find the last extent that starts at or before entry */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ext->extent[mid].first <= entry)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return;
+	extent = &ext->extent[lo - 1];
+	if (entry >= extent->first + extent->blocks)
+		return;
+	binfo->device = extent->device;
+	binfo->offset = extent->offset + (u64)(entry - extent->first) * BLKSIZE;
+}
+
+static void expand_extents(struct blocklist_extents *ext,
+			   struct blocklist_segment *segment,
+			   unsigned int entries)
+{
+	unsigned int i;
+
+	for (i = 0; i < entries; i++)
+		extents_entry(ext, i, &segment->binfo[i]);
+}
+
+/* Keep segment seg as extents, unless that form exists already */
+static void publish_extents(struct tier_device *dev, u64 seg,
+			    struct blocklist_extents *ext)
+{
+	if (cmpxchg(&dev->extents[seg], NULL, ext)) {
+		vfree(ext);
+		return;
+	}
+	atomic64_add(extents_size(ext->count), &dev->blocklist_memory);
+}
+
+/* Free the extents of seg, the caller holds btier_lock or registers */
+static void drop_extents(struct tier_device *dev, u64 seg)
+{
+	struct blocklist_extents *ext = dev->extents[seg];
+
+	dev->extents[seg] = NULL;
+	atomic64_sub(extents_size(ext->count), &dev->blocklist_memory);
+	vfree(ext);
+}
+
+/* blocklist_cache_mb in bytes, 0 is unlimited */
+static u64 blocklist_cache_bytes(struct tier_device *dev)
+{
+	return (u64)dev->blocklist_cache_mb << 20;
+}
+
+static bool blocklist_over_budget(struct tier_device *dev)
+{
+	u64 limit = blocklist_cache_bytes(dev);
+
+	return limit && !dev->inerror &&
+	       atomic64_read(&dev->blocklist_memory) > limit;
+}
+
+/*
+ * The in memory blockinfo of blocknr. Its segment is loaded when this is
+ * the first access to it, from its extents when it has been compacted.
+ * Returns NULL when that fails, or when the segment would have to be read
+ * under generic_make_request, see load_segments.
+ */
+struct blockinfo *blocklist_entry(struct tier_device *dev, u64 blocknr)
+{
+	u64 seg = blocknr >> BLOCKLIST_SEGMENT_SHIFT;
+	struct blocklist_segment *segment;
+	struct blocklist_extents *ext;
+	bool used;
+
+	segment = smp_load_acquire(&dev->segments[seg]);
+	if (unlikely(!segment)) {
+		ext = smp_load_acquire(&dev->extents[seg]);
+		if (ext || test_bit(seg, dev->empty_segments))
+			segment = alloc_segment(dev);
+		else if (current->bio_list)
+			return NULL;
+		else
+			segment = read_segment(dev, seg, &used);
+		if (!segment)
+			return NULL;
+		if (ext)
+			expand_extents(ext, segment, segment_entries(dev, seg));
+		segment = publish_segment(dev, seg, segment);
+		/* the data migrator brings it back within budget */
+		if (blocklist_over_budget(dev))
+			wake_up(&dev->migrate_event);
+	}
+	return &segment->binfo[blocknr & (BLOCKLIST_SEGMENT_BLOCKS - 1)];
+}
+
+/*
+ * Copy the blockinfo of blocknr into binfo without expanding a segment
+ * that is kept as extents. Returns false when the segment can't be read.
+ */
+bool blocklist_peek(struct tier_device *dev, u64 blocknr,
+		    struct blockinfo *binfo)
+{
+	u64 seg = blocknr >> BLOCKLIST_SEGMENT_SHIFT;
+	unsigned int entry = blocknr & (BLOCKLIST_SEGMENT_BLOCKS - 1);
+	struct blocklist_segment *segment;
+	struct blocklist_extents *ext;
+	struct blockinfo *cur;
+
+	segment = smp_load_acquire(&dev->segments[seg]);
+	if (!segment) {
+		/* a segment read from disk is compacted when possible */
+		if (!blocklist_segment_empty(dev, blocknr))
+			segment = smp_load_acquire(&dev->segments[seg]);
+		ext = smp_load_acquire(&dev->extents[seg]);
+		if (!segment && ext) {
+			extents_entry(ext, entry, binfo);
+			return true;
+		}
+	}
+	cur = blocklist_entry(dev, blocknr);
+	if (!cur)
+		return false;
+	*binfo = *cur;
+	return true;
+}
+
+/*
+ * Returns true when the segment of blocknr holds no allocated block, so
+ * that a walk over the blocklist can skip it. A segment that was not
+ * loaded yet is read, but it is only kept in memory when it is in use.
+ * With a blocklist_cache_mb limit it is kept as extents when possible.
+ */
+bool blocklist_segment_empty(struct tier_device *dev, u64 blocknr)
+{
+	u64 seg = blocknr >> BLOCKLIST_SEGMENT_SHIFT;
+	struct blocklist_segment *segment;
+	struct blocklist_extents *ext;
+	bool used;
+
+	if (smp_load_acquire(&dev->segments[seg]) ||
+	    smp_load_acquire(&dev->extents[seg]))
+		return false;
+	if (test_bit(seg, dev->empty_segments))
+		return true;
+	/* not known, blocklist_entry fails on it as well */
+	if (current->bio_list)
+		return false;
+	segment = read_segment(dev, seg, &used);
+	/* a failed alloc leaves it unknown, blocklist_entry fails as well */
+	if (!segment)
+		return dev->inerror;
+	if (!used) {
+		set_bit(seg, dev->empty_segments);
+		vfree(segment);
+		return true;
+	}
+	ext = NULL;
+	if (blocklist_cache_bytes(dev))
+		ext = compact_segment(segment->binfo,
+				      segment_entries(dev, seg));
+	if (ext) {
+		publish_extents(dev, seg, ext);
+		vfree(segment);
+		return false;
+	}
+	publish_segment(dev, seg, segment);
+	return false;
+}
+
+/* True when the segment of blocknr has to be read from disk first */
+bool blocklist_needs_read(struct tier_device *dev, u64 blocknr)
+{
+	u64 seg = blocknr >> BLOCKLIST_SEGMENT_SHIFT;
+
+	return !smp_load_acquire(&dev->segments[seg]) &&
+	       !smp_load_acquire(&dev->extents[seg]) &&
+	       !test_bit(seg, dev->empty_segments);
+}
+
+/*
+ * Read the segments of blocks first up to last that are not in memory.
+ * The io of a segment read under generic_make_request would be queued
+ * behind the bio that needs it, tier_make_request has this done on
+ * btier_wq before it maps a bio. That covers segments that were never
+ * read as well as evicted ones, the qlock held by the bio keeps them in
+ * memory until it is mapped. They are marked referenced so that the
+ * next shrink_blocklist does not evict them again right away.
+ */
+void load_segments(struct tier_device *dev, u64 first, u64 last)
+{
+	u64 blocknr;
+
+	for (blocknr = first & ~(u64)(BLOCKLIST_SEGMENT_BLOCKS - 1);
+	     blocknr <= last && !dev->inerror;
+	     blocknr += BLOCKLIST_SEGMENT_BLOCKS) {
+		if (!blocklist_needs_read(dev, blocknr))
+			continue;
+		if (!blocklist_segment_empty(dev, blocknr))
+			mark_segment_referenced(dev, blocknr);
+	}
+	/* the data migrator brings it back within budget */
+	if (blocklist_over_budget(dev))
+		wake_up(&dev->migrate_event);
+}
+
+/*
+ * Set up the blocklist. Unless lazy_blocklist is set all segments are read
+ * right away, yet only the ones in use stay in memory.
+ */
+static int load_blocklist(struct tier_device *dev)
+{
+	u64 segments = blocklist_segments(dev);
+	u64 seg;
+
+	pr_info("blocklist segments %llu valloc %llu\n", segments,
+		sizeof(struct blocklist_segment *) * segments);
+	dev->segments = vzalloc(sizeof(struct blocklist_segment *) * segments);
+	dev->extents = vzalloc(sizeof(struct blocklist_extents *) * segments);
+	dev->empty_segments =
+	    vzalloc(BITS_TO_LONGS(segments) * sizeof(long));
+	dev->dirty_segments =
+	    vzalloc(BITS_TO_LONGS(segments) * sizeof(long));
+	dev->referenced_segments =
+	    vzalloc(BITS_TO_LONGS(segments) * sizeof(long));
+	if (!dev->segments || !dev->extents || !dev->empty_segments ||
+	    !dev->dirty_segments || !dev->referenced_segments) {
+		vfree(dev->segments);
+		vfree(dev->extents);
+		vfree(dev->empty_segments);
+		vfree(dev->dirty_segments);
+		vfree(dev->referenced_segments);
+		dev->segments = NULL;
+		dev->extents = NULL;
+		dev->empty_segments = NULL;
+		dev->dirty_segments = NULL;
+		dev->referenced_segments = NULL;
+		return -ENOMEM;
+	}
+	atomic64_set(&dev->blocklist_memory, 0);
+	dev->segment_clock = 0;
+	if (lazy_blocklist)
+		return 0;
+
+	for (seg = 0; seg < segments && !dev->inerror; seg++) {
+		if (blocklist_over_budget(dev))
+			shrink_blocklist(dev);
+		blocklist_segment_empty(dev, seg << BLOCKLIST_SEGMENT_SHIFT);
+	}
+	return dev->inerror ? -EIO : 0;
+}
+
+static void free_blocklist(struct tier_device *dev)
 {
-	int alloc_failed = 0;
-	u64 curblock;
-	u64 blocks = dev->size >> BLK_SHIFT;
-	u64 listentries =
-	    btier_div(dev->blocklistsize, sizeof(struct physical_blockinfo));
-	struct backing_device *backdev = dev->backdev[0];
-	int res = 0;
-	struct physical_blockinfo phy_binfo;
-	struct blockinfo *binfo;
+	u64 segments = blocklist_segments(dev);
+	u64 seg;
 
-	pr_info("listentries %llu valloc %llu\n", listentries,
-		sizeof(struct blockinfo *) * listentries);
-	backdev->blocklist = vzalloc(sizeof(struct blockinfo *) * listentries);
-	if (!backdev->blocklist)
-		return -ENOMEM;
+	if (!dev->segments)
+		return;
+	if (0 != flush_blocklist(dev))
+		pr_err("free_blocklist : failed to write back the blocklist\n");
+	for (seg = 0; seg < segments; seg++) {
+		vfree(dev->segments[seg]);
+		vfree(dev->extents[seg]);
+	}
+	vfree(dev->segments);
+	dev->segments = NULL;
+	vfree(dev->extents);
+	dev->extents = NULL;
+	vfree(dev->empty_segments);
+	dev->empty_segments = NULL;
+	vfree(dev->dirty_segments);
+	dev->dirty_segments = NULL;
+	vfree(dev->referenced_segments);
+	dev->referenced_segments = NULL;
+}
+
+/* Drop clean segment seg from memory, it is read again when needed */
+static void evict_segment(struct tier_device *dev, u64 seg)
+{
+	struct blocklist_segment *segment = dev->segments[seg];
+	unsigned int entries = segment_entries(dev, seg);
+	unsigned int i;
 
-	for (curblock = 0; curblock < blocks; curblock++) {
-		binfo = kzalloc(sizeof(struct blockinfo), GFP_KERNEL);
-		if (!binfo) {
-			alloc_failed = 1;
+	for (i = 0; i < entries; i++) {
+		if (segment->binfo[i].device)
 			break;
-		}
-
-		backdev->blocklist[curblock] = binfo;
-
-		res = tier_file_read(dev, 0, &phy_binfo, sizeof(phy_binfo),
-				     backdev->startofblocklist +
-					 (curblock * sizeof(phy_binfo)));
-		if (res != 0)
-			tiererror(dev, "tier_file_read : returned an error");
-
-		copy_physical_blockinfo(binfo, &phy_binfo);
 	}
-
-	if (alloc_failed) {
-		res = -ENOMEM;
-		free_blocklist(dev);
-	}
-
-	return res;
+	if (i == entries)
+		set_bit(seg, dev->empty_segments);
+	else
+		clear_bit(seg, dev->empty_segments);
+	dev->segments[seg] = NULL;
+	vfree(segment);
+	atomic64_sub(sizeof(*segment), &dev->blocklist_memory);
 }
 
-static void free_blocklist(struct tier_device *dev)
+/*
+ * Bring the blocklist back to 7/8 of blocklist_cache_mb. The segments
+ * are written back and then handled in CLOCK order, a segment that was
+ * used by io since the hand passed it gets another round. A cold segment
+ * is kept as extents when it compacts, else it is evicted. Extents are
+ * only evicted once a full round did not free enough. Nothing may hold
+ * a blockinfo meanwhile, the caller holds btier_lock or registers the
+ * device.
+ */
+static void shrink_blocklist(struct tier_device *dev)
 {
-	u64 curblock;
-	u64 blocks = dev->size >> BLK_SHIFT;
-	struct backing_device *backdev = dev->backdev[0];
-	if (!backdev->blocklist)
+	u64 limit = blocklist_cache_bytes(dev);
+	u64 segments = blocklist_segments(dev);
+	struct blocklist_extents *ext;
+	u64 seg, scanned;
+
+	if (!limit || atomic64_read(&dev->blocklist_memory) <= limit ||
+	    dev->inerror)
 		return;
-	for (curblock = 0; curblock < blocks; curblock++) {
-		if (backdev->blocklist[curblock]) {
-			update_blocklist(dev, curblock,
-					 backdev->blocklist[curblock]);
-			kfree(backdev->blocklist[curblock]);
+	if (0 != flush_blocklist(dev)) {
+		pr_err("shrink_blocklist : failed to write back the "
+		       "blocklist\n");
+		return;
+	}
+	limit -= limit >> 3;
+	for (scanned = 0; scanned < 3 * segments &&
+			  atomic64_read(&dev->blocklist_memory) > limit;
+	     scanned++) {
+		seg = dev->segment_clock;
+		if (++dev->segment_clock >= segments)
+			dev->segment_clock = 0;
+		/* extents are outdated once the segment was expanded */
+		if (dev->segments[seg] && dev->extents[seg])
+			drop_extents(dev, seg);
+		if (!dev->segments[seg]) {
+			if (dev->extents[seg] && scanned >= segments)
+				drop_extents(dev, seg);
+			continue;
 		}
+		if (test_and_clear_bit(seg, dev->referenced_segments))
+			continue;
+		ext = compact_segment(dev->segments[seg]->binfo,
+				      segment_entries(dev, seg));
+		if (ext)
+			publish_extents(dev, seg, ext);
+		evict_segment(dev, seg);
 	}
-	vfree(backdev->blocklist);
-	backdev->blocklist = NULL;
 }
 
 static void walk_blocklist(struct tier_device *dev)
 {
 	u64 blocks = dev->size >> BLK_SHIFT;
-	u64 curblock;
-	struct blockinfo *binfo;
+	u64 curblock, resume;
+	struct blockinfo cur, *binfo = &cur;
 	int interrupted = 0;
 	int res = 0;
 	int mincount = 0;
 	u64 devblocks;
+	unsigned int newdevice;
+	unsigned int count = 0;
+	struct migrate_candidate *batch;
 	struct backing_device *backdev;
 	struct data_policy *dtapolicy = &dev->backdev[0]->devmagic->dtapolicy;
 
+	batch = kmalloc_array(TIER_MIGRATE_BATCH, sizeof(*batch), GFP_NOFS);
+	if (!batch) {
+		tiererror(dev, "walk_blocklist : alloc failed");
+		return;
+	}
+
+	release_shadows(dev, -1, true);
 	if (dev->migrate_verbose)
 		pr_info("walk_blocklist start from : %llu\n",
 			dev->resumeblockwalk);
@@ -1003,11 +2193,28 @@ static void walk_blocklist(struct tier_device *dev)
 			pr_info("walk_block_list ends on stop or disabled\n");
 			break;
 		}
-		binfo = get_blockinfo(dev, curblock, 0);
+		if (blocklist_over_budget(dev))
+			shrink_blocklist(dev);
+		if (blocklist_segment_empty(dev, curblock)) {
+			curblock |= BLOCKLIST_SEGMENT_BLOCKS - 1;
+			continue;
+		}
+		/* a segment kept as extents is only expanded on a change */
+		if (!blocklist_peek(dev, curblock, binfo)) {
+			/* out of memory, try again on the next pass */
+			if (!dev->inerror) {
+				dev->resumeblockwalk = curblock;
+				interrupted = 1;
+				break;
+			}
+		} else if (binfo->device) {
+			binfo_sanity(dev, binfo);
+		}
 		if (dev->inerror) {
 			pr_err("walk_block_list stops, device is inerror\n");
 			break;
 		}
+		res = 0;
 		if (binfo->device != 0) {
 			backdev = dev->backdev[binfo->device - 1];
 			devblocks = backdev->devicesize >> BLK_SHIFT;
@@ -1015,10 +2222,16 @@ static void walk_blocklist(struct tier_device *dev)
 			    backdev->devmagic->total_reads, devblocks);
 			backdev->devmagic->average_writes = btier_div(
 			    backdev->devmagic->total_writes, devblocks);
-			res = migrate_down_ifneeded(dev, binfo, curblock);
-			if (!res)
-				res = migrate_up_ifneeded(dev, binfo, curblock);
-			if (!res) {
+			newdevice = migrate_down_target(dev, binfo);
+			if (newdevice == binfo->device)
+				newdevice = migrate_up_target(dev, binfo);
+			if (newdevice != binfo->device) {
+				batch[count].blocknr = curblock;
+				batch[count].offset = binfo->offset;
+				batch[count].device = binfo->device;
+				batch[count].newdevice = newdevice;
+				count++;
+			} else {
 				if (binfo->readcount >= MAX_STAT_COUNT) {
 					binfo->readcount -= MAX_STAT_DECAY;
 					backdev->devmagic->total_reads -=
@@ -1033,13 +2246,21 @@ static void walk_blocklist(struct tier_device *dev)
 					(void)write_blocklist(dev, curblock,
 							      binfo, WC);
 				}
-				update_blocklist(dev, curblock, binfo);
+			}
+		}
+		if (TIER_MIGRATE_BATCH == count) {
+			res = migrate_batch(dev, batch, count, &resume);
+			count = 0;
+			if (-1 != resume) {
+				dev->resumeblockwalk = resume;
+				interrupted = 1;
+				break;
 			}
 		}
 		if (NORMAL_IO == atomic_read(&dev->wqlock)) {
 			mincount++;
-			if (mincount > 5 || res) {
-				dev->resumeblockwalk = curblock;
+			if (mincount > 5 || res || count) {
+				dev->resumeblockwalk = curblock + 1;
 				interrupted = 1;
 				if (dev->migrate_verbose)
 					pr_info("walk_block_list interrupted "
@@ -1048,8 +2269,19 @@ static void walk_blocklist(struct tier_device *dev)
 			}
 		}
 	}
+	if (count && !dev->inerror) {
+		migrate_batch(dev, batch, count, &resume);
+		if (-1 != resume &&
+		    (!interrupted || resume < dev->resumeblockwalk)) {
+			dev->resumeblockwalk = resume;
+			interrupted = 1;
+		}
+	}
+	kfree(batch);
 	if (dev->inerror)
 		return;
+	if (0 != flush_blocklist(dev))
+		pr_err("walk_blocklist : failed to write back the blocklist\n");
 	tier_sync(dev);
 	if (!interrupted) {
 		dev->resumeblockwalk = 0;
@@ -1063,13 +2295,184 @@ static void walk_blocklist(struct tier_device *dev)
 		add_timer(&dev->migrate_timer);
 }
 
+/*
+ * Move block curblock of a lower tier right behind the previous logical
+ * block when that one is on the same tier and the slot behind it is free.
+ * The block keeps its statistics, it does not change tier. Candidates are
+ * only peeked at, the segment is expanded for a block that is moved.
+ * Returns 1 when the block was moved.
+ */
+static int defrag_block(struct tier_device *dev, u64 curblock)
+{
+	struct blockinfo *binfo;
+	struct blockinfo cur, prev;
+	struct blockinfo *orgbinfo;
+	struct backing_device *backdev;
+	u64 slot;
+	int res;
+
+	if (blocklist_needs_read(dev, curblock - 1) ||
+	    !blocklist_peek(dev, curblock, &cur) ||
+	    !blocklist_peek(dev, curblock - 1, &prev))
+		return 0;
+	if (0 == cur.device || 0 == dev->backdev[cur.device - 1]->level)
+		return 0;
+	if (prev.device != cur.device || prev.offset + BLKSIZE == cur.offset)
+		return 0;
+
+	backdev = dev->backdev[cur.device - 1];
+	slot = (prev.offset + BLKSIZE - backdev->startofdata) >> BLK_SHIFT;
+	spin_lock(&backdev->dev_alloc_lock);
+	res = slot_is_free(backdev, slot);
+	spin_unlock(&backdev->dev_alloc_lock);
+	if (!res)
+		return 0;
+	binfo = get_blockinfo(dev, curblock, 0);
+	if (!binfo)
+		return 0;
+
+	orgbinfo = kzalloc(sizeof(struct blockinfo), GFP_NOFS);
+	if (!orgbinfo) {
+		tiererror(dev, "alloc failed");
+		return -ENOMEM;
+	}
+	memcpy(orgbinfo, binfo, sizeof(struct blockinfo));
+
+	/* allocate_dev takes the slot behind prev, nothing allocates now */
+	binfo->device = 0;
+	allocate_dev(dev, curblock, binfo, orgbinfo->device - 1, RANDOM);
+	if (binfo->device && binfo->offset == prev.offset + BLKSIZE &&
+	    move_block(dev, binfo, orgbinfo, curblock)) {
+		if (dev->migrate_verbose)
+			pr_info("defragmented blocknr %llu on device %u "
+				"%llu -> %llu\n",
+				curblock, orgbinfo->device - 1,
+				orgbinfo->offset, binfo->offset);
+		clear_dev_list(dev, orgbinfo);
+		discard_on_real_device(dev, orgbinfo);
+		res = 1;
+	} else {
+		if (binfo->device)
+			clear_dev_list(dev, binfo);
+		memcpy(binfo, orgbinfo, sizeof(struct blockinfo));
+		res = 0;
+	}
+	kfree(orgbinfo);
+	return res;
+}
+
+/*
+ * Relocate at most defrag_rate blocks of the lower tiers per migration
+ * round, so that logical runs become physically contiguous again. A round
+ * looks at no more than TIER_DEFRAG_SCAN blocklist entries, segments that
+ * are empty or not in memory are skipped.
+ */
+static void defrag_blocklist(struct tier_device *dev)
+{
+	u64 blocks = dev->size >> BLK_SHIFT;
+	struct data_policy *dtapolicy = &dev->backdev[0]->devmagic->dtapolicy;
+	unsigned int moved = 0;
+	unsigned int scanned = 0;
+	u64 curblock;
+	int res;
+
+	if (!dev->defrag_rate || dev->attached_devices < 2)
+		return;
+
+	if (0 == dev->resumedefrag)
+		dev->resumedefrag = 1;
+	for (curblock = dev->resumedefrag; curblock < blocks; curblock++) {
+		if (dev->stop || dtapolicy->migration_disabled ||
+		    dev->inerror || moved >= dev->defrag_rate ||
+		    scanned >= TIER_DEFRAG_SCAN ||
+		    NORMAL_IO == atomic_read(&dev->wqlock))
+			break;
+		scanned++;
+		if (blocklist_over_budget(dev))
+			shrink_blocklist(dev);
+		if (blocklist_needs_read(dev, curblock) ||
+		    blocklist_segment_empty(dev, curblock)) {
+			curblock |= BLOCKLIST_SEGMENT_BLOCKS - 1;
+			continue;
+		}
+		res = defrag_block(dev, curblock);
+		if (res < 0)
+			break;
+		moved += res;
+	}
+	dev->resumedefrag = curblock < blocks ? curblock : 0;
+	if (moved) {
+		tier_sync(dev);
+		if (dev->migrate_verbose)
+			pr_info("defrag_blocklist moved %u blocks\n", moved);
+	}
+}
+
+/*
+ * The average physical run length of the logical blocks stored on device,
+ * in hundredths of a block. A run is a sequence of logically adjacent
+ * blocks that are stored next to each other.
+ */
+u64 fragmentation_of_device(struct tier_device *dev, int device)
+{
+	u64 segments = blocklist_segments(dev);
+	struct blocklist_segment *segment, *copy;
+	struct blocklist_extents *ext;
+	struct blockinfo cur, *binfo;
+	u64 allocated = 0, runs = 0;
+	u64 seg, next = 0;
+	unsigned int entries, i;
+	bool used;
+
+	/* keeps the segments from being evicted */
+	down_read(&dev->qlock);
+	for (seg = 0; seg < segments; seg++) {
+		copy = NULL;
+		ext = NULL;
+		segment = smp_load_acquire(&dev->segments[seg]);
+		if (!segment)
+			ext = smp_load_acquire(&dev->extents[seg]);
+		if (!segment && !ext) {
+			next = 0;
+			if (test_bit(seg, dev->empty_segments))
+				continue;
+			/* the statistics do not need it in memory */
+			segment = copy = read_segment(dev, seg, &used);
+			if (!segment)
+				break;
+		}
+		entries = segment_entries(dev, seg);
+		for (i = 0; i < entries; i++) {
+			if (ext) {
+				binfo = &cur;
+				extents_entry(ext, i, binfo);
+			} else {
+				binfo = &segment->binfo[i];
+			}
+			if (binfo->device == device + 1) {
+				allocated++;
+				if (next != binfo->offset)
+					runs++;
+				next = binfo->offset + BLKSIZE;
+			} else {
+				next = 0;
+			}
+		}
+		vfree(copy);
+	}
+	up_read(&dev->qlock);
+	if (!runs)
+		return 0;
+	return div64_u64(allocated * 100, runs);
+}
+
 void do_migrate_direct(struct tier_device *dev)
 {
 	struct data_policy *dtapolicy = &dev->backdev[0]->devmagic->dtapolicy;
 	u64 blocknr = dev->mgdirect.blocknr;
 	int newdevice = dev->mgdirect.newdevice;
 	int res;
-	struct blockinfo *binfo, *orgbinfo;
+	struct blockinfo *binfo;
 
 	btier_lock(dev);
 	if (!dtapolicy->migration_disabled) {
@@ -1092,25 +2495,9 @@ void do_migrate_direct(struct tier_device *dev)
 		       blocknr, newdevice);
 		goto end_error;
 	}
-	orgbinfo = kzalloc(sizeof(struct blockinfo), GFP_NOFS);
-	if (!orgbinfo) {
-		tiererror(dev, "alloc failed");
-		res = -ENOMEM;
-		goto end_error;
-	}
-	memcpy(orgbinfo, binfo, sizeof(*binfo));
-	binfo->device = newdevice + 1;
-
-	res = copyblock(dev, binfo, orgbinfo, blocknr);
-	if (res) {
-		reset_counters_on_migration(dev, orgbinfo);
-		clear_dev_list(dev, orgbinfo);
-		discard_on_real_device(dev, orgbinfo);
-	} else {
+	res = migrate_block(dev, binfo, blocknr, newdevice + 1, -1);
+	if (!res)
 		pr_err("copyblock failed\n");
-		memcpy(binfo, orgbinfo, sizeof(struct blockinfo));
-	}
-	kfree(orgbinfo);
 end_error:
 	btier_unlock(dev);
 }
@@ -1127,12 +2514,28 @@ static void data_migrator(struct work_struct *work)
 		wait_event_interruptible(
 		    dev->migrate_event,
 		    1 == atomic_read(&dev->migrate) || dev->stop ||
-			1 == atomic_read(&dev->mgdirect.direct));
+			1 == atomic_read(&dev->mgdirect.direct) ||
+			blocklist_over_budget(dev));
 		if (dev->migrate_verbose)
 			pr_info("data_migrator woke up\n");
 		if (dev->stop)
 			break;
 
+		if (blocklist_over_budget(dev)) {
+			/*
+			 * Like btier_lock, but a migration that is due
+			 * meanwhile must not be forgotten.
+			 */
+			down_write(&dev->qlock);
+			wait_event(dev->aio_event,
+				   0 == atomic_read(&dev->aio_pending));
+			shrink_blocklist(dev);
+			up_write(&dev->qlock);
+			if (1 != atomic_read(&dev->migrate) &&
+			    1 != atomic_read(&dev->mgdirect.direct))
+				continue;
+		}
+
 		if (1 == atomic_read(&dev->mgdirect.direct)) {
 			if (dev->migrate_verbose)
 				pr_info("do_migrate_direct\n");
@@ -1155,6 +2558,8 @@ static void data_migrator(struct work_struct *work)
 		btier_lock(dev);
 		tier_sync(dev);
 		walk_blocklist(dev);
+		if (0 == dev->resumeblockwalk)
+			defrag_blocklist(dev);
 		btier_unlock(dev);
 		if (dev->migrate_verbose)
 			pr_info("data_migrator goes back to sleep\n");
@@ -1250,111 +2655,104 @@ static void wipe_bitlist(struct tier_device *dev, int device,
 	kfree(buffer);
 }
 
+/* Bytes allocated on device, from the counter kept along the bitlist */
 u64 allocated_on_device(struct tier_device *dev, int device)
 {
-	u_char *buffer = NULL;
-	u64 offset = 0;
-	int i;
-	u64 allocated = 0;
-	int hascache = 0;
+	struct backing_device *backdev = dev->backdev[device];
+	u64 allocated;
 
-	if (dev->backdev[device]->bitlist)
-		hascache = 1;
-	buffer = kzalloc(PAGE_SIZE, GFP_KERNEL);
-	if (!buffer) {
-		tiererror(dev, "allocated_on_device : alloc failed");
-		return 0 - 1;
-	}
-
-	if (!hascache) {
-		while (offset < dev->backdev[device]->bitlistsize) {
-			tier_file_read(dev, device, buffer, PAGE_SIZE,
-				       dev->backdev[device]->startofbitlist +
-					   offset);
-			offset += PAGE_SIZE;
-			for (i = 0; i < PAGE_SIZE; i++) {
-				if (buffer[i] == 0xff)
-					allocated += BLKSIZE;
-			}
-		}
-		if (offset < dev->backdev[device]->bitlistsize) {
-			tier_file_read(
-			    dev, device, buffer,
-			    dev->backdev[device]->bitlistsize - offset,
-			    dev->backdev[device]->startofbitlist + offset);
-		}
-	} else {
-		while (offset < dev->backdev[device]->bitlistsize) {
-			memcpy(buffer, &dev->backdev[device]->bitlist[offset],
-			       PAGE_SIZE);
-			offset += PAGE_SIZE;
-			for (i = 0; i < PAGE_SIZE; i++) {
-				if (buffer[i] == 0xff)
-					allocated += BLKSIZE;
-			}
-		}
-		if (offset < dev->backdev[device]->bitlistsize) {
-			memset(buffer, 0, PAGE_SIZE);
-			memcpy(buffer, &dev->backdev[device]->bitlist[offset],
-			       dev->backdev[device]->bitlistsize - offset);
-		}
-	}
-	for (i = 0; i < dev->backdev[device]->bitlistsize - offset; i++) {
-		if (i >= PAGE_SIZE) {
-			pr_err("allocated_on_device : buffer overflow, should "
-			       "never happen\n");
-			break;
-		}
-		if (buffer[i] == 0xff)
-			allocated += BLKSIZE;
-	}
-	kfree(buffer);
-	return allocated;
+	spin_lock(&backdev->dev_alloc_lock);
+	allocated = backdev->allocated_blocks;
+	spin_unlock(&backdev->dev_alloc_lock);
+	return allocated << BLK_SHIFT;
 }
 
+/*
+ * Rebuild the bitlists after an unclean shutdown. The bitlists are
+ * rebuilt in memory from the loaded blocklist in one pass, and then
+ * written back with large writes and a single flush per device.
+ */
 static void repair_bitlists(struct tier_device *dev)
 {
 	u64 blocknr;
-	struct blockinfo *binfo;
-	u64 relative_offset;
+	struct blockinfo cur, *binfo = &cur;
+	struct backing_device *backdev;
+	u64 slot, offset, len, size;
 	unsigned int i;
+	int res = 0;
 
 	pr_info("repair_bitlists : clearing and rebuilding bitlists\n");
 	for (i = 0; i < dev->attached_devices; i++) {
-		wipe_bitlist(dev, i, dev->backdev[i]->startofbitlist,
-			     dev->backdev[i]->bitlistsize);
-		dev->backdev[i]->free_offset = 0;
+		backdev = dev->backdev[i];
+		memset(backdev->bitlist, 0,
+		       TIER_BITLIST_BYTES(backdev->bitlistsize));
+		backdev->free_offset = 0;
 	}
 
-	for (blocknr = 0; blocknr<dev->size>> BLK_SHIFT; blocknr++) {
-		binfo = get_blockinfo(dev, blocknr, 0);
-		if (dev->inerror)
+	for (blocknr = 0; blocknr < dev->size >> BLK_SHIFT; blocknr++) {
+		if (blocklist_over_budget(dev))
+			shrink_blocklist(dev);
+		if (blocklist_segment_empty(dev, blocknr)) {
+			blocknr |= BLOCKLIST_SEGMENT_BLOCKS - 1;
+			continue;
+		}
+		/* only a corrupted entry needs its segment expanded */
+		if (!blocklist_peek(dev, blocknr, binfo)) {
+			tiererror(dev, "repair_bitlists : failed to read the "
+				       "blocklist");
 			return;
-		if (0 != binfo->device) {
-			if (binfo->device > dev->attached_devices) {
-				pr_err("repair_bitlists : cleared corrupted "
-				       "blocklist entry for blocknr %llu\n",
-				       blocknr);
-				memset(binfo, 0, sizeof(struct blockinfo));
-				continue;
-			}
-			if (BLKSIZE + binfo->offset >
-			    dev->backdev[binfo->device - 1]->devicesize) {
-				pr_err("repair_bitlists : cleared corrupted "
-				       "blocklist entry for blocknr %llu\n",
-				       blocknr);
-				memset(binfo, 0, sizeof(struct blockinfo));
-				continue;
+		}
+		if (0 == binfo->device)
+			continue;
+		backdev = NULL;
+		if (binfo->device <= dev->attached_devices)
+			backdev = dev->backdev[binfo->device - 1];
+		if (!backdev || binfo->offset < backdev->startofdata ||
+		    BLKSIZE + binfo->offset > backdev->devicesize) {
+			pr_err("repair_bitlists : cleared corrupted "
+			       "blocklist entry for blocknr %llu\n",
+			       blocknr);
+			binfo = blocklist_entry(dev, blocknr);
+			if (!binfo) {
+				tiererror(dev, "repair_bitlists : failed to "
+					       "clear a blocklist entry");
+				return;
 			}
-			relative_offset =
-			    binfo->offset -
-			    dev->backdev[binfo->device - 1]->startofdata;
-			mark_offset_as_used(dev, binfo->device - 1,
-					    relative_offset);
-			dev->backdev[i]->free_offset =
-			    relative_offset >> BLK_SHIFT;
+			memset(binfo, 0, sizeof(struct blockinfo));
+			mark_blockinfo_dirty(dev, blocknr);
+			binfo = &cur;
+			continue;
+		}
+		slot = (binfo->offset - backdev->startofdata) >> BLK_SHIFT;
+		__set_bit_le(slot, backdev->bitlist);
+	}
+	for (i = 0; i < dev->attached_devices; i++) {
+		backdev = dev->backdev[i];
+		backdev->allocated_blocks =
+		    bitmap_weight(backdev->bitlist, bitlist_slots(backdev));
+	}
+
+	for (i = 0; i < dev->attached_devices && !res; i++) {
+		backdev = dev->backdev[i];
+		size = TIER_BITLIST_BYTES(backdev->bitlistsize);
+		for (offset = 0; offset < size; offset += len) {
+			len = min_t(u64, size - offset, BLKSIZE);
+			res = tier_file_write(dev, i,
+					      (u8 *)backdev->bitlist + offset,
+					      len, backdev->startofbitlist +
+						       offset);
+			if (res)
+				break;
 		}
+		if (!res)
+			res = tier_meta_sync(
+			    dev, i, backdev->startofbitlist,
+			    backdev->startofbitlist + size - 1);
 	}
+	if (!res)
+		res = flush_blocklist(dev);
+	if (res)
+		tiererror(dev, "repair_bitlists : failed to write bitlists");
 }
 
 char *uuid_hash(char *data, int hashlen)
@@ -1404,6 +2802,112 @@ char *btier_uuid(struct tier_device *dev)
 	return asc;
 }
 
+/*
+ * The limits of the backing queue are read once, get_chunksize uses them
+ * for every bio that is submitted to the device.
+ */
+static void cache_queue_limits(struct backing_device *backdev)
+{
+	struct request_queue *q = bdev_get_queue(backdev->bdev);
+
+	backdev->max_chunk =
+	    min(queue_max_hw_sectors(q), queue_max_sectors(q)) << 9;
+	backdev->max_segments =
+	    min_t(unsigned int, BIO_MAX_PAGES, queue_max_segments(q));
+}
+
+/*
+ * Map the metadata device when it is DAX capable persistent memory, so
+ * that metadata updates become cache line flushes instead of block
+ * writes and fsyncs. Any other metadata device keeps using block I/O.
+ */
+static void map_metadata_pmem(struct tier_device *dev)
+{
+	struct backing_device *metadev = dev->metadev;
+	struct block_device *bdev = I_BDEV(metadev->fds->f_mapping->host);
+	const char *devicename = metadev->fds->f_path.dentry->d_name.name;
+	u64 size = i_size_read(bdev->bd_inode);
+	void __pmem *addr;
+	long avail;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	struct blk_dax_ctl dax = {
+		.sector = 0,
+		.size = size,
+	};
+#else
+	unsigned long pfn;
+#endif
+
+	if (!arch_has_pmem_api())
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	avail = bdev_direct_access(bdev, &dax);
+	addr = dax.addr;
+#else
+	avail = bdev_direct_access(bdev, 0, &addr, &pfn, size);
+#endif
+	if (avail < 0 || (u64)avail < size) {
+		pr_info("metadata device %s is not mapped as persistent "
+			"memory\n",
+			devicename);
+		return;
+	}
+	/* btier_setup wrote the metadata through the page cache */
+	vfs_fsync(metadev->fds, 0);
+	invalidate_mapping_pages(metadev->fds->f_mapping, 0, -1);
+	metadev->pmem = addr;
+	metadev->pmem_size = size;
+	pr_info("metadata device %s is mapped as persistent memory\n",
+		devicename);
+}
+
+/*
+ * Point device to the file that holds its metadata, which is either the
+ * device itself or the metadata device that all tiers were created with.
+ */
+static int attach_metadata(struct tier_device *dev, int device)
+{
+	struct backing_device *backdev = dev->backdev[device];
+	struct devicemagic *metamagic;
+	const char *devicename = backdev->fds->f_path.dentry->d_name.name;
+	int res = 0;
+
+	if (!backdev->devmagic->external_meta) {
+		if (dev->metadev) {
+			pr_err("device %s keeps its own metadata, it can't be "
+			       "used with a metadata device\n",
+			       devicename);
+			return -EINVAL;
+		}
+		backdev->metafds = backdev->fds;
+		backdev->journal_offset = 0;
+		backdev->pmem = NULL;
+		return 0;
+	}
+	if (!dev->metadev) {
+		pr_err("device %s needs its metadata device\n", devicename);
+		return -EINVAL;
+	}
+	metamagic = kzalloc(sizeof(*metamagic), GFP_KERNEL);
+	if (!metamagic)
+		return -ENOMEM;
+	__tier_file_read(dev, dev->metadev->fds, metamagic, sizeof(*metamagic),
+			 0);
+	/* The header of the metadata device counts the tiers it serves */
+	if (TIER_DEVICE_META_MAGIC != metamagic->magic ||
+	    metamagic->device != dev->attached_devices) {
+		pr_err("%s is not the metadata device of %s\n",
+		       dev->metadev->fds->f_path.dentry->d_name.name,
+		       devicename);
+		res = -EINVAL;
+	}
+	kfree(metamagic);
+	backdev->metafds = dev->metadev->fds;
+	backdev->journal_offset = (device + 1) * TIER_JOURNAL_SLOT;
+	backdev->pmem = dev->metadev->pmem;
+	return res;
+}
+
 static int order_devices(struct tier_device *dev)
 {
 	int swap = 0;
@@ -1462,8 +2966,26 @@ static int order_devices(struct tier_device *dev)
 			kfree(devmagic);
 		}
 	}
+	if (dev->metadev && !dev->metadev->pmem)
+		map_metadata_pmem(dev);
 	/* Mark as inuse */
 	for (i = 0; i < dev->attached_devices; i++) {
+		devicename = dev->backdev[i]->fds->f_path.dentry->d_name.name;
+		if (TIER_DEVICE_PACKED_MAGIC !=
+		    dev->backdev[i]->devmagic->magic) {
+			pr_err("device %s has an old bitlist format, "
+			       "run btier_setup to convert it\n",
+			       devicename);
+			res = -EINVAL;
+			goto end_error;
+		}
+		res = attach_metadata(dev, i);
+		if (res)
+			goto end_error;
+		/* Not before the swap, a mutex can't be copied */
+		mutex_init(&dev->backdev[i]->bitlist_mutex);
+		dev->backdev[i]->allocated_blocks =
+		    dev->backdev[i]->devmagic->allocated_blocks;
 		if (CLEAN != dev->backdev[i]->devmagic->clean) {
 			tier_check(dev, i);
 			clean = 0;
@@ -1489,17 +3011,38 @@ static int order_devices(struct tier_device *dev)
 			pr_info("device %s is a file\n", devicename);
 		} else {
 			dev->backdev[i]->bdev = bdev;
+			cache_queue_limits(dev->backdev[i]);
 			pr_info("device %s is a real device\n", devicename);
 		}
 	}
+	/* Adjacent devices of the same tier group share one level */
+	dev->levels = 0;
+	for (i = 0; i < dev->attached_devices; i++) {
+		devmagic = dev->backdev[i]->devmagic;
+		if (0 == i || 0 == devmagic->tier_group ||
+		    devmagic->tier_group !=
+			dev->backdev[i - 1]->devmagic->tier_group) {
+			dev->level[dev->levels].first = i;
+			dev->level[dev->levels].members = 0;
+			dev->levels++;
+		}
+		dev->backdev[i]->level = dev->levels - 1;
+		dev->level[dev->levels - 1].members++;
+	}
+	for (i = 0; i < dev->levels; i++) {
+		if (dev->level[i].members > 1)
+			pr_info("tier level %u is a group of %u devices\n", i,
+				dev->level[i].members);
+	}
+
 	dtapolicy = &dev->backdev[0]->devmagic->dtapolicy;
 	if (dtapolicy->sequential_landing >= dev->attached_devices)
 		dtapolicy->sequential_landing = 0;
 	if (0 == dtapolicy->migration_interval)
 		dtapolicy->migration_interval = MIGRATE_INTERVAL;
 
-	if (!clean)
-		repair_bitlists(dev);
+	/* the bitlists are rebuilt once the blocklist is loaded */
+	dev->unclean_shutdown = !clean;
 	kfree(backdev);
 	kfree(zhash);
 	return 0;
@@ -1574,19 +3117,30 @@ static void free_moving_bio(struct tier_device *dev)
 	dev->moving_bio = NULL;
 }
 
+/*
+ * The block locks are hashed on blocknr. The number of locks depends on
+ * the number of cpus that can issue io concurrently, not on the size of
+ * the device.
+ */
 static int alloc_blocklock(struct tier_device *dev)
 {
-	unsigned int size;
-	u64 i, blocks = dev->size >> BLK_SHIFT;
+	u64 blocks = dev->size >> BLK_SHIFT;
+	unsigned long locks;
+	unsigned int i;
 
-	size = blocks * sizeof(struct mutex);
+	locks = num_possible_cpus() * BTIER_BLOCK_LOCKS_PER_CPU;
+	if (locks > blocks)
+		locks = blocks;
+	/* hash_64 needs at least one bit */
+	locks = roundup_pow_of_two(max_t(unsigned long, locks, 2));
+	dev->block_lock_bits = ilog2(locks);
 
-	dev->block_lock = vzalloc(size);
+	dev->block_lock = vzalloc(locks * sizeof(struct mutex));
 
 	if (!dev->block_lock)
 		return -ENOMEM;
 
-	for (i = 0; i < blocks; i++) {
+	for (i = 0; i < locks; i++) {
 		mutex_init(dev->block_lock + i);
 	}
 
@@ -1595,12 +3149,12 @@ static int alloc_blocklock(struct tier_device *dev)
 
 static void free_blocklock(struct tier_device *dev)
 {
-	u64 i, blocks = dev->size >> BLK_SHIFT;
+	unsigned int i, locks = 1 << dev->block_lock_bits;
 
 	if (!dev->block_lock)
 		return;
 
-	for (i = 0; i < blocks; i++) {
+	for (i = 0; i < locks; i++) {
 		mutex_destroy(dev->block_lock + i);
 	}
 
@@ -1644,10 +3198,18 @@ static int tier_register(struct tier_device *dev)
 	pr_info("%s size : %llu\n", dev->devname, dev->size);
 	spin_lock_init(&dev->dbg_lock);
 	spin_lock_init(&dev->io_seq_lock);
+	spin_lock_init(&dev->trim_lock);
+	INIT_RADIX_TREE(&dev->trim_tree, GFP_ATOMIC);
+	atomic_set(&dev->trimmed_blocks, 0);
+	spin_lock_init(&dev->shadow_lock);
+	INIT_RADIX_TREE(&dev->shadow_tree, GFP_ATOMIC);
+	atomic_set(&dev->shadowed_blocks, 0);
 
 	if (!(dev->bio_task = mempool_create_slab_pool(32, bio_task_cache)) ||
 	    !(dev->bio_meta =
 		  mempool_create_kmalloc_pool(32, sizeof(struct bio_meta))) ||
+	    !(dev->bio_remap =
+		  mempool_create_kmalloc_pool(64, sizeof(struct bio_remap))) ||
 	    alloc_blocklock(dev) || alloc_moving_bio(dev) ||
 	    !(q = blk_alloc_queue(GFP_KERNEL))) {
 		pr_err("Memory allocation failed in tier_register \n");
@@ -1655,17 +3217,24 @@ static int tier_register(struct tier_device *dev)
 		goto out;
 	}
 
+	/* The blocklist may already wake up the data migrator */
+	init_waitqueue_head(&dev->migrate_event);
+	init_waitqueue_head(&dev->aio_event);
+	dev->blocklist_cache_mb = blocklist_cache_mb;
 	ret = load_blocklist(dev);
 	if (0 != ret)
 		goto out;
 	ret = load_bitlists(dev);
 	if (0 != ret)
 		goto out;
-
-	init_waitqueue_head(&dev->migrate_event);
-	init_waitqueue_head(&dev->aio_event);
+	if (dev->unclean_shutdown) {
+		repair_bitlists(dev);
+		dev->unclean_shutdown = 0;
+	}
 
 	dev->migrate_verbose = 0;
+	dev->defrag_rate = TIER_DEFRAG_RATE;
+	dev->resumedefrag = 0;
 	dev->stop = 0;
 
 	atomic_set(&dev->migrate, 0);
@@ -1694,8 +3263,8 @@ static int tier_register(struct tier_device *dev)
 	q->limits.max_hw_sectors =
 	    q->limits.max_segment_size * q->limits.max_segments;
 	q->limits.max_sectors = q->limits.max_hw_sectors;
-	q->limits.discard_granularity = BLKSIZE;
-	q->limits.discard_alignment = BLKSIZE;
+	q->limits.discard_granularity = TIER_TRIM_UNIT;
+	q->limits.discard_alignment = 0;
 	set_bit(QUEUE_FLAG_NONROT, &q->queue_flags);
 	set_bit(QUEUE_FLAG_DISCARD, &q->queue_flags);
 	blk_queue_flush(q, REQ_FLUSH | REQ_FUA);
@@ -1862,12 +3431,16 @@ static void tier_deregister(struct tier_device *dev)
 		kfree(dev->aioname);
 		release_devicename(dev->devname);
 
+		release_shadows(dev, -1, false);
 		tier_sync(dev);
 		free_blocklist(dev);
 		free_bitlists(dev);
+		free_trim_tree(dev);
 		free_blocklock(dev);
 		free_moving_bio(dev);
 
+		if (dev->metadev)
+			vfs_fsync(dev->metadev->fds, 0);
 		for (i = 0; i < dev->attached_devices; i++) {
 			mark_device_clean(dev, i);
 			filp_close(dev->backdev[i]->fds, NULL);
@@ -1878,11 +3451,21 @@ static void tier_deregister(struct tier_device *dev)
 		}
 
 		kfree(dev->backdev);
+		if (dev->metadev) {
+			/* Readers of the page cache must see the pmem updates */
+			if (dev->metadev->pmem)
+				invalidate_mapping_pages(
+				    dev->metadev->fds->f_mapping, 0, -1);
+			filp_close(dev->metadev->fds, NULL);
+			kfree(dev->metadev);
+		}
 
 		if (dev->bio_task)
 			mempool_destroy(dev->bio_task);
 		if (dev->bio_meta)
 			mempool_destroy(dev->bio_meta);
+		if (dev->bio_remap)
+			mempool_destroy(dev->bio_remap);
 
 		kfree(dev);
 		dev = NULL;
@@ -1925,9 +3508,10 @@ static int determine_device_size(struct tier_device *dev)
 		backdev->startofdata = TIER_HEADERSIZE;
 		backdev->startofbitlist = backdev->devmagic->startofbitlist;
 		backdev->devicesize = backdev->devmagic->devicesize;
-		if (i > 0) {
+		if (backdev->devmagic->external_meta)
+			backdev->endofdata = backdev->devicesize - 1;
+		else if (i > 0)
 			backdev->endofdata = backdev->startofbitlist - 1;
-		}
 		pr_info("backdev->devicesize      : 0x%llx (%llu)\n",
 			backdev->devicesize, backdev->devicesize);
 		pr_info("backdev->startofdata     : 0x%llx\n",
@@ -2029,7 +3613,8 @@ static int migrate_bitlist(struct tier_device *dev, int devicenr,
 	}
 	wipe_bitlist(dev, devicenr, newstartofbitlist, newbitlistsize);
 	res = copylist(dev, devicenr, dev->backdev[devicenr]->startofbitlist,
-		       dev->backdev[devicenr]->bitlistsize, newstartofbitlist);
+		       TIER_BITLIST_BYTES(dev->backdev[devicenr]->bitlistsize),
+		       newstartofbitlist);
 	if (res != 0)
 		return res;
 	// Make sure the new bitlist is synced to disk before
@@ -2064,10 +3649,14 @@ static int migrate_data_if_needed(struct tier_device *dev, u64 startofblocklist,
 		return -ENOMEM;
 	}
 	for (curblock = 0; curblock < blocks; curblock++) {
+		if (blocklist_segment_empty(dev, curblock)) {
+			curblock |= BLOCKLIST_SEGMENT_BLOCKS - 1;
+			continue;
+		}
 		/* Do not update the blocks metadata */
 		orgbinfo = get_blockinfo(dev, curblock, 0);
-		if (dev->inerror) {
-			res = -EIO;
+		if (!orgbinfo) {
+			res = dev->inerror ? -EIO : -ENOMEM;
 			break;
 		}
 		// Migrating blocks from device 0 + 1;
@@ -2087,7 +3676,7 @@ static int migrate_data_if_needed(struct tier_device *dev, u64 startofblocklist,
 				"device %u\n",
 				curblock, orgbinfo->device - 1,
 				binfo->device - 1);
-			cbres = copyblock(dev, binfo, orgbinfo, curblock);
+			cbres = copyblock(dev, binfo, orgbinfo, curblock, -1);
 			if (cbres) {
 				reset_counters_on_migration(dev, orgbinfo);
 				clear_dev_list(dev, orgbinfo);
@@ -2210,6 +3799,10 @@ void resize_tier(struct tier_device *dev)
 	u64 newbitlistsize_total = 0;
 	int found = 0;
 
+	if (dev->metadev) {
+		pr_err("resize is not supported with a metadata device\n");
+		return;
+	}
 	for (count = 0; count < dev->attached_devices; count++) {
 		curdevsize =
 		    KERNEL_SECTORSIZE * tier_get_size(dev->backdev[count]->fds);
@@ -2298,6 +3891,7 @@ static long tier_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			device = devnew;
 		}
 		list_add_tail(&devnew->list, &device_list);
+		init_rwsem(&devnew->blocklist_lock);
 		devnew->backdev =
 		    kzalloc(sizeof(struct backing_device *) * MAX_BACKING_DEV,
 			    GFP_KERNEL);
@@ -2326,6 +3920,25 @@ static long tier_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 		dev->attached_devices++;
 		break;
+	case TIER_SET_METAFD:
+		err = -EEXIST;
+		if (dev->metadev || 0 != dev->tier_device_number)
+			break;
+		err = -ENOMEM;
+		dev->metadev =
+		    kzalloc(sizeof(struct backing_device), GFP_KERNEL);
+		if (!dev->metadev)
+			break;
+		if (copy_from_user(&fds, (struct fd_s __user *)arg,
+				   sizeof(fds))) {
+			err = -EFAULT;
+		} else
+			err = tier_set_fd(dev, &fds, dev->metadev);
+		if (err) {
+			kfree(dev->metadev);
+			dev->metadev = NULL;
+		}
+		break;
 	case TIER_SET_SECTORSIZE:
 		err = -EEXIST;
 		if (0 != dev->tier_device_number)
@@ -2,14 +2,20 @@
 #define _BTIER_MAIN_H_
 
 static loff_t tier_get_size(struct file *);
+static int __tier_file_write(struct tier_device *, struct file *, void *,
+			     size_t, loff_t);
+static int __tier_file_read(struct tier_device *, struct file *, void *,
+			    const int, loff_t);
 static int tier_file_write(struct tier_device *, unsigned int, void *, size_t,
 			   loff_t);
 static int tier_file_read(struct tier_device *, unsigned int, void *, const int,
 			  loff_t);
 struct file *get_dev_file(struct tier_device *, unsigned int);
+static int tier_meta_sync(struct tier_device *, unsigned int, loff_t, loff_t);
 static void sync_device(struct tier_device *, int);
-static int migrate_up_ifneeded(struct tier_device *, struct blockinfo *, u64);
-static int migrate_down_ifneeded(struct tier_device *, struct blockinfo *, u64);
 static void free_blocklist(struct tier_device *);
+static void shrink_blocklist(struct tier_device *);
+static bool blocklist_over_budget(struct tier_device *);
+static void release_shadows(struct tier_device *, int, bool);
 
 #endif /* _BTIER_MAIN_H_ */
@@ -26,24 +26,22 @@ static void tier_submit_bio(struct tier_device *dev, unsigned int device,
 	clear_debug_info(dev, BIO);
 }
 
-unsigned int get_chunksize(struct block_device *bdev, struct bio *bio)
+/*
+ * Return the size of the next piece of bio that can be submitted to
+ * backdev as one bio, at most max bytes. The segments are only walked
+ * up to that size, so splitting a bio costs one pass over its segments.
+ */
+unsigned int get_chunksize(struct backing_device *backdev, struct bio *bio,
+			   unsigned int max)
 {
-	struct request_queue *q = bdev_get_queue(bdev);
-	unsigned int chunksize;
-	unsigned int max_hwsectors;
-	unsigned int max_sectors;
-	unsigned ret = 0, seg = 0;
+	unsigned int chunksize = min(backdev->max_chunk, max);
+	unsigned int ret = 0, seg = 0;
 	struct bio_vec bv;
 	struct bvec_iter iter;
 
-	max_hwsectors = queue_max_hw_sectors(q);
-	max_sectors = queue_max_sectors(q);
-	chunksize = min(max_hwsectors, max_sectors) << 9;
-
 	bio_for_each_segment(bv, bio, iter)
 	{
-		if (seg ==
-		    min_t(unsigned, BIO_MAX_PAGES, queue_max_segments(q)))
+		if (seg == backdev->max_segments || ret >= chunksize)
 			break;
 
 		seg++;
@@ -55,41 +53,29 @@ unsigned int get_chunksize(struct block_device *bdev, struct bio *bio)
 	/* chunksize should be aligned with sectors */
 	WARN_ON(chunksize & ((1 << 9) - 1));
 
-	ret = max_t(int, chunksize, bio_iovec(bio).bv_len);
-
-	if (chunksize > BLKSIZE)
-		chunksize = BLKSIZE;
-
 	return chunksize;
 }
 
-static int tier_moving_io(struct tier_device *dev, struct blockinfo *binfo,
-			  int rw)
+/*
+ * Submit bio, which covers a whole block, to the block of binfo and wait
+ * for it. It is split up as the backing device needs it.
+ */
+static int tier_block_io_wait(struct tier_device *dev,
+			      struct blockinfo *binfo, struct bio *bio,
+			      int rw)
 {
-	struct block_device *bdev = dev->backdev[binfo->device - 1]->bdev;
-	struct bio *bio = dev->moving_bio;
 	unsigned int done = 0;
 	unsigned int cur_chunk = 0;
 	struct bio *split;
 	sector_t start;
 	int res = 0;
 
-	if (!bdev)
-		return -EPERM;
-
-	bio_reset(bio);
-	bio->bi_bdev = bdev;
-	bio->bi_rw = rw;
-	bio->bi_vcnt = BLKSIZE >> PAGE_SHIFT;
+	bio->bi_bdev = dev->backdev[binfo->device - 1]->bdev;
 	bio->bi_iter.bi_sector = binfo->offset >> 9;
-	bio->bi_iter.bi_size = BLKSIZE;
-	bio->bi_iter.bi_idx = 0;
-	bio->bi_iter.bi_bvec_done = 0;
 
 	do {
-		cur_chunk = get_chunksize(bdev, bio);
-		if (cur_chunk > (BLKSIZE - done))
-			cur_chunk = BLKSIZE - done;
+		cur_chunk = get_chunksize(dev->backdev[binfo->device - 1], bio,
+					  BLKSIZE - done);
 
 		/* if no splits, and whole block is in one bio */
 		if (1 == atomic_read(&bio->__bi_remaining) &&
@@ -121,6 +107,25 @@ static int tier_moving_io(struct tier_device *dev, struct blockinfo *binfo,
 	return -EPERM;
 }
 
+static int tier_moving_io(struct tier_device *dev, struct blockinfo *binfo,
+			  int rw)
+{
+	struct block_device *bdev = dev->backdev[binfo->device - 1]->bdev;
+	struct bio *bio = dev->moving_bio;
+
+	if (!bdev)
+		return -EPERM;
+
+	bio_reset(bio);
+	bio->bi_rw = rw;
+	bio->bi_vcnt = BLKSIZE >> PAGE_SHIFT;
+	bio->bi_iter.bi_size = BLKSIZE;
+	bio->bi_iter.bi_idx = 0;
+	bio->bi_iter.bi_bvec_done = 0;
+
+	return tier_block_io_wait(dev, binfo, bio, rw);
+}
+
 int tier_moving_block(struct tier_device *dev, struct blockinfo *olddevice,
 		      struct blockinfo *newdevice)
 {
@@ -143,28 +148,26 @@ int tier_moving_block(struct tier_device *dev, struct blockinfo *olddevice,
 	return 0;
 }
 
-static inline void increase_iostats(struct bio_task *bt)
+static inline void increase_iostats(struct tier_device *dev, int rw,
+				    int iotype)
 {
-	struct tier_device *dev = bt->dev;
-	int rw = bio_rw(bt->parent_bio);
-
 	if (rw) {
-		if (bt->iotype == RANDOM)
+		if (iotype == RANDOM)
 			atomic64_inc(&dev->stats.rand_writes);
 		else
 			atomic64_inc(&dev->stats.seq_writes);
 	} else {
-		if (bt->iotype == RANDOM)
+		if (iotype == RANDOM)
 			atomic64_inc(&dev->stats.rand_reads);
 		else
 			atomic64_inc(&dev->stats.seq_reads);
 	}
 }
 
-static inline void determine_iotype(struct bio_task *bt, u64 blocknr)
+static inline int determine_iotype(struct tier_device *dev, u64 blocknr)
 {
 	int ioswitch = 0;
-	struct tier_device *dev = bt->dev;
+	int iotype;
 
 	spin_lock(&dev->io_seq_lock);
 
@@ -180,40 +183,121 @@ static inline void determine_iotype(struct bio_task *bt, u64 blocknr)
 	}
 
 	if (dev->insequence > 5) {
-		bt->iotype = SEQUENTIAL;
+		iotype = SEQUENTIAL;
 	} else {
-		bt->iotype = RANDOM;
+		iotype = RANDOM;
 	}
 
 	dev->lastblocknr = blocknr;
 
 	spin_unlock(&dev->io_seq_lock);
+	return iotype;
 }
 
 /* from bio->bi_iter.bi_sector, memset size of it to 0;
    size is guaranteed to be <= bi_size */
 static void bio_fill_zero(struct bio *bio, unsigned int size)
 {
-	unsigned long flags;
 	struct bio_vec bv;
 	struct bvec_iter iter;
 	unsigned int done = 0;
+	unsigned int len;
 
 	bio_for_each_segment(bv, bio, iter)
 	{
-		char *data = bvec_kmap_irq(&bv, &flags);
-		memset(data, 0, bv.bv_len);
-		flush_dcache_page(bv.bv_page);
-		bvec_kunmap_irq(data, &flags);
+		len = min(bv.bv_len, size - done);
+		zero_user(bv.bv_page, bv.bv_offset, len);
 
-		done += bv.bv_len;
+		done += len;
 		if (done >= size)
 			break;
 	}
 }
 
+/*
+ * Lockless read of the mapping of a block. Returns false when the mapping
+ * is being changed, or looks corrupt, the caller then has to take the
+ * block lock.
+ */
+static bool binfo_read_mapping(struct tier_device *dev,
+			       struct blockinfo *binfo, unsigned int *device,
+			       u64 *offset)
+{
+	u32 seq;
+
+	if (!binfo)
+		return false;
+	seq = READ_ONCE(binfo->seq);
+	if (seq & 1)
+		return false;
+	smp_rmb();
+	*device = READ_ONCE(binfo->device);
+	*offset = READ_ONCE(binfo->offset);
+	smp_rmb();
+	if (seq != READ_ONCE(binfo->seq))
+		return false;
+
+	if (*device > dev->attached_devices)
+		return false;
+	if (*device && *offset > dev->backdev[*device - 1]->devicesize)
+		return false;
+	return true;
+}
+
+/* Complete a read that only covers unallocated blocks directly */
+static bool tier_read_hole(struct tier_device *dev, struct bio *bio)
+{
+	u64 blk = bio->bi_iter.bi_sector >> (BLK_SHIFT - 9);
+	u64 end_blk = (bio_end_sector(bio) - 1) >> (BLK_SHIFT - 9);
+	u64 cur_blk;
+	unsigned int device;
+	u64 offset;
+
+	for (cur_blk = blk; cur_blk <= end_blk; cur_blk++) {
+		/* a hole in a segment that is not loaded stays unloaded */
+		if (blocklist_segment_empty(dev, cur_blk))
+			continue;
+		if (!binfo_read_mapping(dev, blocklist_entry(dev, cur_blk),
+					&device, &offset) ||
+		    0 != device)
+			return false;
+	}
+
+	for (cur_blk = blk; cur_blk <= end_blk; cur_blk++)
+		increase_iostats(dev, READ, determine_iotype(dev, cur_blk));
+
+	zero_fill_bio(bio);
+	bio_endio(bio);
+	return true;
+}
+
+/* Return true when the first size bytes of the bio data are all zero */
+static bool bio_data_is_zero(struct bio *bio, unsigned int size)
+{
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	unsigned int done = 0;
+	unsigned int len;
+	void *data;
+	bool zero = true;
+
+	bio_for_each_segment(bv, bio, iter)
+	{
+		len = min(bv.bv_len, size - done);
+		data = kmap_atomic(bv.bv_page);
+		if (memchr_inv(data + bv.bv_offset, 0, len))
+			zero = false;
+		kunmap_atomic(data);
+
+		done += len;
+		if (!zero || done >= size)
+			break;
+	}
+	return zero;
+}
+
 /* Check for corruption */
-static int binfo_sanity(struct tier_device *dev, struct blockinfo *binfo)
+int binfo_sanity(struct tier_device *dev, struct blockinfo *binfo)
 {
 	struct backing_device *backdev = dev->backdev[binfo->device - 1];
 
@@ -237,6 +321,39 @@ static int binfo_sanity(struct tier_device *dev, struct blockinfo *binfo)
 	return 1;
 }
 
+/*
+ * Update accesstime and hitcount of a block stored on device.
+ * The counters are statistics only, readers that do not hold the
+ * block lock may lose an update.
+ */
+static void update_blockinfo_stats(struct tier_device *dev, u64 blocknr,
+				   struct blockinfo *binfo,
+				   unsigned int device, int updatemeta)
+{
+	struct backing_device *backdev = dev->backdev[device - 1];
+
+	if (updatemeta == TIERREAD) {
+		if (binfo->readcount < MAX_STAT_COUNT) {
+			binfo->readcount++;
+			spin_lock(&backdev->magic_lock);
+			backdev->devmagic->total_reads++;
+			spin_unlock(&backdev->magic_lock);
+		}
+	} else {
+		if (binfo->writecount < MAX_STAT_COUNT) {
+			binfo->writecount++;
+			spin_lock(&backdev->magic_lock);
+			backdev->devmagic->total_writes++;
+			spin_unlock(&backdev->magic_lock);
+		}
+		shadow_stale(dev, blocknr);
+	}
+
+	binfo->lastused = get_seconds();
+	mark_blockinfo_dirty(dev, blocknr);
+	mark_segment_referenced(dev, blocknr);
+}
+
 /*
  * Read the metadata of the blocknr specified.
  * When a blocknr is not yet allocated binfo->device is 0; otherwhise > 0.
@@ -248,40 +365,23 @@ struct blockinfo *get_blockinfo(struct tier_device *dev, u64 blocknr,
 {
 	/* The blocklist starts at the end of the bitlist on device1 */
 	struct blockinfo *binfo;
-	struct backing_device *backdev = dev->backdev[0];
 
 	if (dev->inerror)
 		return NULL;
 
-	binfo = backdev->blocklist[blocknr];
+	binfo = blocklist_entry(dev, blocknr);
+	if (!binfo)
+		return NULL;
 
 	if (0 != binfo->device) {
 		if (!binfo_sanity(dev, binfo)) {
 			binfo = NULL;
 			goto err_ret;
 		}
-		backdev = dev->backdev[binfo->device - 1];
-
 		/* update accesstime and hitcount */
-		if (updatemeta > 0) {
-			if (updatemeta == TIERREAD) {
-				if (binfo->readcount < MAX_STAT_COUNT) {
-					binfo->readcount++;
-					spin_lock(&backdev->magic_lock);
-					backdev->devmagic->total_reads++;
-					spin_unlock(&backdev->magic_lock);
-				}
-			} else {
-				if (binfo->writecount < MAX_STAT_COUNT) {
-					binfo->writecount++;
-					spin_lock(&backdev->magic_lock);
-					backdev->devmagic->total_writes++;
-					spin_unlock(&backdev->magic_lock);
-				}
-			}
-
-			binfo->lastused = get_seconds();
-		}
+		if (updatemeta > 0)
+			update_blockinfo_stats(dev, blocknr, binfo,
+					       binfo->device, updatemeta);
 	}
 
 err_ret:
@@ -292,7 +392,9 @@ static int allocate_block(struct tier_device *dev, u64 blocknr,
 			  struct blockinfo *binfo, struct bio_task *bt)
 {
 	int device = 0;
-	int count = 0;
+	unsigned int level = 0;
+	unsigned int count, member;
+	struct tier_level *tl;
 	struct backing_device *backdev = dev->backdev[0];
 
 	/* Sequential writes will go to SAS or SATA */
@@ -300,81 +402,494 @@ static int allocate_block(struct tier_device *dev, u64 blocknr,
 		spin_lock(&backdev->magic_lock);
 		device = backdev->devmagic->dtapolicy.sequential_landing;
 		spin_unlock(&backdev->magic_lock);
+		level = dev->backdev[device]->level;
 	}
 
-	while (1) {
-		if (0 != allocate_dev(dev, blocknr, binfo, device))
-			return -EIO;
-		if (0 != binfo->device) {
-			if (0 != write_blocklist(dev, blocknr, binfo, WA))
+	/*
+	 * Try the members of a tier group starting with the one that blocknr
+	 * is striped to, then the next levels
+	 */
+	for (count = 0; count < dev->levels; count++) {
+		tl = &dev->level[level];
+		device = group_member(dev, level, blocknr);
+		for (member = 0; member < tl->members; member++) {
+			if (0 != allocate_dev(dev, blocknr, binfo, device,
+					      bt->iotype))
 				return -EIO;
-			break;
-		}
-		device++;
-		count++;
-		if (count >= dev->attached_devices) {
-			pr_err("no free space found, this should never "
-			       "happen!!\n");
-			return -ENOSPC;
+			if (0 != binfo->device) {
+				if (0 != write_blocklist(dev, blocknr, binfo,
+							 WA))
+					return -EIO;
+				return 0;
+			}
+			if (++device == tl->first + tl->members)
+				device = tl->first;
 		}
-		if (device >= dev->attached_devices)
-			device = 0;
+		if (++level == dev->levels)
+			level = 0;
 	}
+	pr_err("no free space found, this should never happen!!\n");
+	return -ENOSPC;
+}
+
+struct discard_wait {
+	atomic_t pending;
+	struct completion event;
+};
+
+static void discard_endio(struct bio *bio)
+{
+	struct discard_wait *dw = bio->bi_private;
+
+	if (bio->bi_error && bio->bi_error != -EOPNOTSUPP)
+		pr_debug("discard on backing device failed : %i\n",
+			 bio->bi_error);
+	bio_put(bio);
+	if (atomic_dec_and_test(&dw->pending))
+		complete(&dw->event);
+}
+
+/* Issue asynchronous discards for size bytes at offset of a device */
+static void tier_issue_discard(struct tier_device *dev,
+			       struct discard_wait *dw, unsigned int device,
+			       u64 offset, u64 size)
+{
+	struct block_device *bdev = dev->backdev[device]->bdev;
+	sector_t sector = offset >> 9;
+	sector_t nr_sects = size >> 9;
+	unsigned int max_sects, len;
+	struct request_queue *q;
+	struct bio *bio;
+
+	if (!bdev)
+		return;
+	q = bdev_get_queue(bdev);
+	if (!blk_queue_discard(q))
+		return;
+
+	max_sects = min_t(unsigned int, q->limits.max_discard_sectors,
+			  UINT_MAX >> 9);
+	if (max_sects >= BLKSIZE >> 9)
+		max_sects = round_down(max_sects, BLKSIZE >> 9);
+	else
+		max_sects =
+		    round_down(max_sects, bdev_logical_block_size(bdev) >> 9);
+	if (!max_sects)
+		return;
+
+	while (nr_sects) {
+		len = min_t(sector_t, nr_sects, max_sects);
+		bio = bio_alloc(GFP_NOIO, 1);
+		bio->bi_iter.bi_sector = sector;
+		bio->bi_iter.bi_size = len << 9;
+		bio->bi_bdev = bdev;
+		bio->bi_end_io = discard_endio;
+		bio->bi_private = dw;
+		atomic_inc(&dw->pending);
+		set_debug_info(dev, BIO);
+		submit_bio(REQ_WRITE | REQ_DISCARD, bio);
+		clear_debug_info(dev, BIO);
+		sector += len;
+		nr_sects -= len;
+	}
+}
+
+int cmp_freed_block(const void *a, const void *b)
+{
+	const struct freed_block *x = a, *y = b;
+
+	if (x->device != y->device)
+		return x->device < y->device ? -1 : 1;
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
 	return 0;
 }
 
-/* Reset blockinfo for this block to unused and clear the
-   bitlist for this block
+/*
+ * Map the discarded blocks back to their old location when the batch
+ * could not be persisted, unless a write allocated the block meanwhile.
+ * The old location is then released instead.
+ */
+static void tier_discard_restore(struct tier_device *dev,
+				 struct freed_block *blocks, unsigned int count)
+{
+	struct blockinfo *binfo;
+	struct blockinfo old;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		memset(&old, 0, sizeof(old));
+		old.device = blocks[i].device + 1;
+		old.offset = blocks[i].offset;
+		mutex_lock(tier_block_lock(dev, blocks[i].blocknr));
+		binfo = blocklist_entry(dev, blocks[i].blocknr);
+		if (binfo && 0 == binfo->device) {
+			binfo_write_begin(binfo);
+			binfo->device = old.device;
+			binfo->offset = old.offset;
+			binfo_write_end(binfo);
+			mark_blockinfo_dirty(dev, blocks[i].blocknr);
+		} else if (binfo) {
+			clear_dev_list(dev, &old);
+		}
+		mutex_unlock(tier_block_lock(dev, blocks[i].blocknr));
+	}
+}
+
+/*
+ * Persist the blocklist of nrblocks blocks starting at blocknr in one go,
+ * send merged discards for the freed blocks to the backing devices and
+ * wait for them. Only then the freed blocks are released in the bitlists,
+ * so that a new allocation can never be hit by a discard still in flight.
+ * Blocks that could not be released are mapped again.
+ */
+static int tier_discard_batch(struct tier_device *dev,
+			      struct freed_block *blocks, unsigned int count,
+			      u64 blocknr, u64 nrblocks)
+{
+	struct discard_wait dw;
+	unsigned int i, j, run;
+	int ret, res;
+
+	ret = write_blocklist_range(dev, blocknr, nrblocks);
+	if (ret) {
+		tier_discard_restore(dev, blocks, count);
+		return ret;
+	}
+
+	sort(blocks, count, sizeof(*blocks), cmp_freed_block, NULL);
+
+	if (dev->discard_to_devices) {
+		atomic_set(&dw.pending, 1);
+		init_completion(&dw.event);
+		for (i = 0; i < count; i += run) {
+			for (run = 1; i + run < count &&
+				      blocks[i + run].device ==
+					  blocks[i].device &&
+				      blocks[i + run].offset ==
+					  blocks[i].offset + run * BLKSIZE;
+			     run++)
+				;
+			tier_issue_discard(dev, &dw, blocks[i].device,
+					   blocks[i].offset,
+					   (u64)run * BLKSIZE);
+		}
+		if (!atomic_dec_and_test(&dw.pending))
+			wait_for_completion(&dw.event);
+	}
+
+	/* per device, a failed device keeps its blocks allocated */
+	for (i = 0; i < count; i = j) {
+		for (j = i; j < count && blocks[j].device == blocks[i].device;
+		     j++)
+			;
+		res = clear_dev_list_batch(dev, &blocks[i], j - i);
+		if (res) {
+			tier_discard_restore(dev, &blocks[i], j - i);
+			ret = res;
+		}
+	}
+	if (ret)
+		(void)write_blocklist_range(dev, blocknr, nrblocks);
+	return ret;
+}
+
+/*
+ * Partially discarded blocks keep a bitmap of trimmed TIER_TRIM_UNIT
+ * pieces in dev->trim_tree. The bitmap of a block is only modified while
+ * holding its block lock, trim_lock protects the tree itself.
+ * The bitmaps are not persistent, they are lost on deregister.
+ */
+static unsigned long *trim_lookup(struct tier_device *dev, u64 blocknr)
+{
+	unsigned long *map;
+
+	if (!atomic_read(&dev->trimmed_blocks))
+		return NULL;
+	spin_lock(&dev->trim_lock);
+	map = radix_tree_lookup(&dev->trim_tree, blocknr);
+	spin_unlock(&dev->trim_lock);
+	return map;
+}
+
+static void trim_forget(struct tier_device *dev, u64 blocknr)
+{
+	unsigned long *map;
+
+	if (!atomic_read(&dev->trimmed_blocks))
+		return;
+	spin_lock(&dev->trim_lock);
+	map = radix_tree_delete(&dev->trim_tree, blocknr);
+	spin_unlock(&dev->trim_lock);
+	if (map) {
+		atomic_dec(&dev->trimmed_blocks);
+		kfree(map);
+	}
+}
+
+/* A write to a block makes the written pieces in use again */
+static void trim_clear(struct tier_device *dev, u64 blocknr,
+		       unsigned int offset, unsigned int size)
+{
+	unsigned long *map = trim_lookup(dev, blocknr);
+	unsigned int first, last;
+
+	if (!map)
+		return;
+	first = offset / TIER_TRIM_UNIT;
+	last = DIV_ROUND_UP(offset + size, TIER_TRIM_UNIT);
+	bitmap_clear(map, first, last - first);
+	if (bitmap_empty(map, TIER_TRIM_BITS))
+		trim_forget(dev, blocknr);
+}
+
+/*
+ * Mark the whole TIER_TRIM_UNIT pieces of [offset, offset + size) in an
+ * allocated block as trimmed. Returns true when the block is now
+ * completely trimmed and can be freed like a full block discard.
+ * The trimmed pieces are optionally discarded on the backing device.
+ */
+static bool trim_partial(struct tier_device *dev, struct discard_wait *dw,
+			 u64 blocknr, struct blockinfo *binfo,
+			 unsigned int offset, unsigned int size)
+{
+	unsigned long *map;
+	unsigned int first, last;
+	int ret;
+
+	first = DIV_ROUND_UP(offset, TIER_TRIM_UNIT);
+	last = (offset + size) / TIER_TRIM_UNIT;
+	if (first >= last)
+		return false;
+
+	map = trim_lookup(dev, blocknr);
+	if (!map) {
+		map = kzalloc(BITS_TO_LONGS(TIER_TRIM_BITS) * sizeof(long),
+			      GFP_NOIO);
+		if (!map)
+			return false;
+		if (radix_tree_preload(GFP_NOIO)) {
+			kfree(map);
+			return false;
+		}
+		spin_lock(&dev->trim_lock);
+		ret = radix_tree_insert(&dev->trim_tree, blocknr, map);
+		spin_unlock(&dev->trim_lock);
+		radix_tree_preload_end();
+		if (ret) {
+			kfree(map);
+			return false;
+		}
+		atomic_inc(&dev->trimmed_blocks);
+	}
+
+	bitmap_set(map, first, last - first);
+	if (bitmap_full(map, TIER_TRIM_BITS)) {
+		trim_forget(dev, blocknr);
+		return true;
+	}
+
+	if (dev->discard_to_devices &&
+	    dev->backdev[binfo->device - 1]->bdev &&
+	    blk_queue_nonrot(
+		bdev_get_queue(dev->backdev[binfo->device - 1]->bdev)))
+		tier_issue_discard(dev, dw, binfo->device - 1,
+				   binfo->offset + first * TIER_TRIM_UNIT,
+				   (u64)(last - first) * TIER_TRIM_UNIT);
+	return false;
+}
+
+/*
+ * Free all bitmaps. They are looked up in batches and only deleted
+ * afterwards, a delete may free the node that an iterator is on.
+ */
+void free_trim_tree(struct tier_device *dev)
+{
+	void **slots[TIER_TREE_GANG];
+	unsigned long indices[TIER_TREE_GANG];
+	unsigned long *maps[TIER_TREE_GANG];
+	unsigned long next = 0;
+	unsigned int count, i;
+
+	do {
+		count = radix_tree_gang_lookup_slot(&dev->trim_tree, slots,
+						    indices, next,
+						    TIER_TREE_GANG);
+		for (i = 0; i < count; i++)
+			maps[i] = radix_tree_deref_slot(slots[i]);
+		for (i = 0; i < count; i++) {
+			radix_tree_delete(&dev->trim_tree, indices[i]);
+			kfree(maps[i]);
+			next = indices[i] + 1;
+		}
+	} while (count == TIER_TREE_GANG);
+	atomic_set(&dev->trimmed_blocks, 0);
+}
+
+/* Reset blockinfo for the blocks in this range to unused and clear the
+   bitlist for these blocks. Metadata is persisted and backing devices
+   are discarded per batch of TIER_DISCARD_BATCH blocks.
+   Parts of a range that do not cover a whole block are tracked until
+   the block is completely trimmed.
 */
-void tier_discard(struct tier_device *dev, u64 offset, unsigned int size)
+static int tier_discard(struct tier_device *dev, u64 offset,
+			unsigned int size)
 {
 	struct blockinfo *binfo;
+	struct freed_block *blocks;
+	struct discard_wait dw;
+	unsigned int count = 0;
+	unsigned int offset_in_blk, size_in_blk;
 	u64 blocknr;
 	u64 lastblocknr;
-	u64 curoff;
+	u64 batchstart;
 	u64 start;
+	u64 blkstart;
+	int ret = 0;
 
 	pr_debug("Got a discard request offset %llu len %u\n", offset, size);
 
-	if (!dev->discard)
-		return;
-	curoff = offset + size;
-	lastblocknr = curoff >> BLK_SHIFT;
+	if (!dev->discard || !size)
+		return 0;
 	start = offset >> BLK_SHIFT;
-	/* Make sure we don't discard a block while a part of it is still inuse
-	 */
-	if ((start << BLK_SHIFT) < offset)
-		start++;
-	if ((start << BLK_SHIFT) > (offset + size))
-		return;
+	lastblocknr = ((offset + size - 1) >> BLK_SHIFT) + 1;
+
+	blocks = vmalloc(min_t(u64, lastblocknr - start, TIER_DISCARD_BATCH) *
+			 sizeof(*blocks));
+	if (!blocks)
+		return -ENOMEM;
+
+	atomic_set(&dw.pending, 1);
+	init_completion(&dw.event);
 
+	batchstart = start;
 	for (blocknr = start; blocknr < lastblocknr; blocknr++) {
-		mutex_lock(dev->block_lock + blocknr);
+		blkstart = blocknr << BLK_SHIFT;
+		offset_in_blk = max(offset, blkstart) - blkstart;
+		size_in_blk =
+		    min(offset + size, blkstart + BLKSIZE) - blkstart -
+		    offset_in_blk;
+
+		if (blocklist_segment_empty(dev, blocknr)) {
+			/* nothing to discard up to the end of the segment */
+			blocknr |= BLOCKLIST_SEGMENT_BLOCKS - 1;
+			if (blocknr >= lastblocknr)
+				blocknr = lastblocknr - 1;
+			goto batch;
+		}
+		mutex_lock(tier_block_lock(dev, blocknr));
 		binfo = get_blockinfo(dev, blocknr, 0);
-		if (dev->inerror) {
-			mutex_unlock(dev->block_lock + blocknr);
+		if (!binfo) {
+			mutex_unlock(tier_block_lock(dev, blocknr));
+			ret = dev->inerror ? -EIO : -ENOMEM;
 			break;
 		}
-		if (binfo->device != 0) {
+		if (binfo->device != 0 &&
+		    (size_in_blk == BLKSIZE ||
+		     trim_partial(dev, &dw, blocknr, binfo, offset_in_blk,
+				  size_in_blk))) {
 			pr_debug("really discard blocknr %llu at offset %llu "
 				 "size %u\n",
 				 blocknr, offset, size);
-			clear_dev_list(dev, binfo);
+			trim_forget(dev, blocknr);
+			shadow_stale(dev, blocknr);
+			blocks[count].device = binfo->device - 1;
+			blocks[count].offset = binfo->offset;
+			blocks[count].blocknr = blocknr;
+			count++;
 			reset_counters_on_migration(dev, binfo);
-			discard_on_real_device(dev, binfo);
-			memset(binfo, 0, sizeof(struct blockinfo));
-			write_blocklist(dev, blocknr, binfo, WD);
+			binfo_write_begin(binfo);
+			binfo->device = 0;
+			binfo->offset = 0;
+			binfo->lastused = 0;
+			binfo->readcount = 0;
+			binfo->writecount = 0;
+			binfo_write_end(binfo);
+		}
+		mutex_unlock(tier_block_lock(dev, blocknr));
+batch:
+		if (blocknr + 1 - batchstart >= TIER_DISCARD_BATCH ||
+		    blocknr + 1 == lastblocknr) {
+			if (count)
+				ret = tier_discard_batch(
+				    dev, blocks, count, batchstart,
+				    blocknr + 1 - batchstart);
+			count = 0;
+			batchstart = blocknr + 1;
+			if (ret)
+				break;
 		}
-		mutex_unlock(dev->block_lock + blocknr);
 
 		/* in case it's a huge discard */
 		cond_resched();
 	}
+
+	/* wait for discards of partially trimmed blocks */
+	if (!atomic_dec_and_test(&dw.pending))
+		wait_for_completion(&dw.event);
+
+	vfree(blocks);
+	return ret;
+}
+
+/*
+ * Discards are handled asynchronously, the parent bio is completed
+ * from the work queue once metadata and backing devices are done.
+ */
+static void tier_discard_work(struct work_struct *work)
+{
+	struct bio_meta *bm = container_of(work, struct bio_meta, work);
+	struct tier_device *dev = bm->dev;
+	struct bio *parent_bio = bm->parent_bio;
+	int ret;
+
+	set_debug_info(dev, DISCARD);
+	ret = tier_discard(dev, parent_bio->bi_iter.bi_sector << 9,
+			   parent_bio->bi_iter.bi_size);
+	clear_debug_info(dev, DISCARD);
+	if (ret)
+		pr_err("discard failed : %i\n", ret);
+
+	parent_bio->bi_error = ret;
+	bio_endio(parent_bio);
+	atomic_dec(&dev->aio_pending);
+	wake_up(&dev->aio_event);
+	mempool_free(bm, dev->bio_meta);
+}
+
+/*
+ * Write the part of bm->bt that overwrites block bm->blocknr as a whole
+ * to a new block on bm->newdevice, then have redirect_block switch the
+ * mapping over to it. The old block is only released after that. Returns
+ * 1 when the block was redirected, else the caller writes it in place.
+ */
+static int tier_redirect(struct bio_meta *bm)
+{
+	struct tier_device *dev = bm->dev;
+	struct bio *bio = &bm->bio;
+	struct blockinfo newbinfo;
+
+	memset(&newbinfo, 0, sizeof(newbinfo));
+	if (0 != allocate_dev(dev, bm->blocknr, &newbinfo, bm->newdevice - 1,
+			      RANDOM) ||
+	    0 == newbinfo.device)
+		return 0;
+
+	bio_init(bio);
+	__bio_clone_fast(bio, &bm->bt->bio);
+	bio->bi_iter.bi_size = BLKSIZE;
+	if (0 != tier_block_io_wait(dev, &newbinfo, bio, WRITE)) {
+		pr_err("redirect of blocknr %llu failed, write in place\n",
+		       bm->blocknr);
+		clear_dev_list(dev, &newbinfo);
+		return 0;
+	}
+	return redirect_block(dev, bm->blocknr, bm->binfo, &newbinfo);
 }
 
 /*
- * Btier meta data operations, such as FLUSH/FUA, discard, and read/write
- * blocklist and bit list on backing devices.
+ * Btier meta data operations, such as FLUSH/FUA and block allocation,
+ * which read/write blocklist and bit list on backing devices.
  * Pending make_request will be waiting for those to be finished.
  * Cannot call them under generic_make_request, use a work queue.
  */
@@ -403,13 +918,6 @@ static void tier_meta_work(struct work_struct *work)
 		clear_debug_info(dev, PRESYNC);
 	}
 
-	if (bm->discard) {
-		set_debug_info(dev, DISCARD);
-		tier_discard(dev, parent_bio->bi_iter.bi_sector << 9,
-			     parent_bio->bi_iter.bi_size);
-		clear_debug_info(dev, DISCARD);
-	}
-
 	if (bm->allocate) {
 		set_debug_info(dev, PREALLOCBLOCK);
 		ret = allocate_block(dev, bm->blocknr, bm->binfo, bm->bt);
@@ -418,6 +926,20 @@ static void tier_meta_work(struct work_struct *work)
 			pr_crit("Failed to allocate_block\n");
 	}
 
+	if (bm->load) {
+		set_debug_info(dev, PREBINFO);
+		load_segments(dev, bm->blocknr,
+			      (bio_end_sector(parent_bio) - 1) >>
+				  (BLK_SHIFT - 9));
+		clear_debug_info(dev, PREBINFO);
+	}
+
+	if (bm->redirect) {
+		set_debug_info(dev, PREALLOCBLOCK);
+		tier_redirect(bm);
+		clear_debug_info(dev, PREALLOCBLOCK);
+	}
+
 	bm->ret = ret;
 	complete(&bm->event);
 }
@@ -435,7 +957,7 @@ static void tier_submit_and_wait_meta(struct bio_meta *bm)
 	/* wait until all those bio meta works have been finished*/
 	wait_for_completion(&bm->event);
 
-	if (bm->discard || bm->flush) {
+	if (bm->flush) {
 		bio_endio(bm->parent_bio);
 		atomic_dec(&dev->aio_pending);
 		wake_up(&dev->aio_event);
@@ -479,7 +1001,8 @@ static inline void tier_dev_discard(struct tier_device *dev,
 	bm->discard = 1;
 	bm->parent_bio = parent_bio;
 
-	tier_submit_and_wait_meta(bm);
+	INIT_WORK(&bm->work, tier_discard_work);
+	queue_work(btier_wq, &bm->work);
 }
 
 static inline void tier_dev_allocate(struct tier_device *dev, u64 blocknr,
@@ -500,29 +1023,158 @@ static inline void tier_dev_allocate(struct tier_device *dev, u64 blocknr,
 	tier_submit_and_wait_meta(bm);
 }
 
+/*
+ * Have the blocklist segments of parent_bio that are not in memory read
+ * on btier_wq, when there are any.
+ */
+static inline void tier_dev_load(struct tier_device *dev,
+				 struct bio *parent_bio)
+{
+	u64 first = parent_bio->bi_iter.bi_sector >> (BLK_SHIFT - 9);
+	u64 last = (bio_end_sector(parent_bio) - 1) >> (BLK_SHIFT - 9);
+	struct bio_meta *bm;
+	u64 blocknr;
+
+	for (blocknr = first; blocknr <= last;
+	     blocknr = (blocknr | (BLOCKLIST_SEGMENT_BLOCKS - 1)) + 1) {
+		if (blocklist_needs_read(dev, blocknr))
+			break;
+	}
+	if (blocknr > last)
+		return;
+
+	bm = mempool_alloc(dev->bio_meta, GFP_NOIO);
+	memset(bm, 0, sizeof(*bm));
+
+	bm->dev = dev;
+	bm->load = 1;
+	bm->parent_bio = parent_bio;
+	bm->blocknr = blocknr;
+
+	tier_submit_and_wait_meta(bm);
+}
+
+/*
+ * Have the whole block overwrite of bt on blocknr written to newdevice.
+ * The mapping in binfo tells whether that was done.
+ */
+static inline void tier_dev_redirect(struct tier_device *dev, u64 blocknr,
+				     struct blockinfo *binfo,
+				     struct bio_task *bt,
+				     unsigned int newdevice)
+{
+	struct bio_meta *bm;
+
+	bm = mempool_alloc(dev->bio_meta, GFP_NOIO);
+	memset(bm, 0, sizeof(*bm));
+
+	bm->dev = dev;
+	bm->redirect = 1;
+	bm->binfo = binfo;
+	bm->blocknr = blocknr;
+	bm->bt = bt;
+	bm->newdevice = newdevice;
+
+	tier_submit_and_wait_meta(bm);
+}
+
 static void request_endio(struct bio *bio)
 {
 	struct bio_task *bt = bio->bi_private;
 	struct tier_device *dev = bt->dev;
 
+	if (bio->bi_error)
+		bt->parent_bio->bi_error = bio->bi_error;
 	bio_endio(bt->parent_bio);
 	atomic_dec(&dev->aio_pending);
 	wake_up(&dev->aio_event);
 	mempool_free(bt, dev->bio_task);
 }
 
+/*
+ * Extend an io on block blocknr, that is stored at phys on device, with
+ * the following blocks of the bio that are stored right behind it on the
+ * same device. Such a run is submitted as one bio instead of one bio per
+ * block. Returns the size of the run, *last_blk is its last block.
+ * A write only extends over blocks whose block lock it gets, those stay
+ * locked until tier_unlock_run.
+ */
+static unsigned int tier_extend_run(struct tier_device *dev, struct bio *bio,
+				    int rw, u64 blocknr, u64 end_blk,
+				    unsigned int device, u64 phys,
+				    unsigned int size, u64 *last_blk)
+{
+	struct blockinfo *binfo, cur;
+	unsigned int next_device;
+	unsigned int part;
+	u64 next_phys;
+	u64 next;
+
+	for (next = blocknr + 1; next <= end_blk; next++) {
+		/* a write holds the lock of every block of the run */
+		if (rw && !mutex_trylock(tier_block_lock(dev, next)))
+			break;
+		binfo = blocklist_entry(dev, next);
+		if (!binfo_read_mapping(dev, binfo, &next_device, &next_phys) ||
+		    next_device != device ||
+		    next_phys != phys + ((next - blocknr) << BLK_SHIFT)) {
+			if (rw)
+				mutex_unlock(tier_block_lock(dev, next));
+			break;
+		}
+
+		part = min_t(unsigned int, BLKSIZE,
+			     bio->bi_iter.bi_size - size);
+		/* a block that moves up on overwrite starts a new run */
+		if (rw && BLKSIZE == part) {
+			cur = *binfo;
+			cur.device = next_device;
+			if (overwrite_target(dev, &cur)) {
+				mutex_unlock(tier_block_lock(dev, next));
+				break;
+			}
+		}
+		increase_iostats(dev, rw, determine_iotype(dev, next));
+		update_blockinfo_stats(dev, next, binfo, device,
+				       rw ? TIERWRITE : TIERREAD);
+		if (rw)
+			trim_clear(dev, next, 0, part);
+		size += part;
+	}
+
+	*last_blk = next - 1;
+	return size;
+}
+
+/*
+ * Drop the block lock of blocknr when it is held and the locks that
+ * tier_extend_run took for the following blocks of a write.
+ */
+static void tier_unlock_run(struct tier_device *dev, u64 blocknr,
+			    u64 last_blk, bool locked, int rw)
+{
+	u64 next;
+
+	if (locked)
+		mutex_unlock(tier_block_lock(dev, blocknr));
+	if (rw)
+		for (next = blocknr + 1; next <= last_blk; next++)
+			mutex_unlock(tier_block_lock(dev, next));
+}
+
 static void tiered_dev_access(struct tier_device *dev, struct bio_task *bt)
 {
 	struct bio *bio = &bt->bio;
-	u64 end_blk, cur_blk = 0, offset;
+	u64 end_blk, cur_blk = 0, last_blk, offset, phys;
 	struct blockinfo *binfo;
 	unsigned int offset_in_blk, size_in_blk;
 	int rw = bio_rw(bt->parent_bio);
 	unsigned int done = 0;
 	unsigned int cur_chunk = 0;
 	sector_t start = 0;
-	unsigned int device;
+	unsigned int device, newdevice;
 	struct bio *split;
+	bool hole, locked;
 
 	end_blk = ((bio_end_sector(bio) - 1) << 9) >> BLK_SHIFT;
 
@@ -533,73 +1185,145 @@ static void tiered_dev_access(struct tier_device *dev, struct bio_task *bt)
 		size_in_blk = (cur_blk == end_blk) ? bio->bi_iter.bi_size
 						   : (BLKSIZE - offset_in_blk);
 
-		determine_iotype(bt, cur_blk);
-		increase_iostats(bt);
-
-		mutex_lock(dev->block_lock + cur_blk);
-
-		if (rw)
-			binfo = get_blockinfo(dev, cur_blk, TIERWRITE);
-		else
-			binfo = get_blockinfo(dev, cur_blk, TIERREAD);
+		bt->iotype = determine_iotype(dev, cur_blk);
+		increase_iostats(dev, rw, bt->iotype);
 
-		/* read unallocated block, return data zero */
-		if (unlikely(!rw && 0 == binfo->device)) {
+		/*
+		 * Reads of an allocated block or of a hole do not need the
+		 * block lock when the mapping is not changed meanwhile. A
+		 * block that is allocated concurrently has not been written
+		 * yet, reading it as zeros is correct. A segment of the
+		 * blocklist without allocated blocks is not even loaded.
+		 */
+		locked = false;
+		hole = false;
+		binfo = NULL;
+		if (!rw && blocklist_segment_empty(dev, cur_blk)) {
+			device = 0;
+			hole = true;
+		} else {
+			binfo = blocklist_entry(dev, cur_blk);
+		}
+		if (!rw && !dev->inerror && (hole || (binfo &&
+		    binfo_read_mapping(dev, binfo, &device, &phys)))) {
+			if (0 == device)
+				hole = true;
+			else
+				update_blockinfo_stats(dev, cur_blk, binfo,
+						       device, TIERREAD);
+		} else {
+			mutex_lock(tier_block_lock(dev, cur_blk));
+			locked = true;
+
+			if (rw)
+				binfo =
+				    get_blockinfo(dev, cur_blk, TIERWRITE);
+			else
+				binfo = get_blockinfo(dev, cur_blk, TIERREAD);
+			if (!binfo) {
+				mutex_unlock(tier_block_lock(dev, cur_blk));
+				/* a failed segment alloc only fails this bio */
+				bio->bi_error = dev->inerror ? -EIO : -ENOMEM;
+				goto bio_failed;
+			}
 
-			mutex_unlock(dev->block_lock + cur_blk);
+			/*
+			 * write zeros to unallocated block, leave it
+			 * unallocated since it already reads back as zeros.
+			 */
+			if (0 == binfo->device &&
+			    (!rw || bio_data_is_zero(bio, size_in_blk))) {
+				mutex_unlock(tier_block_lock(dev, cur_blk));
+				hole = true;
+			}
+		}
 
-			bio_fill_zero(bio, size_in_blk);
+		if (hole) {
+			if (!rw)
+				bio_fill_zero(bio, size_in_blk);
 
 			bio_advance(bio, size_in_blk);
 
-			/* total splits is 0 and it's now last blk of bio.*/
-			if (1 == atomic_read(&bio->__bi_remaining) &&
-			    cur_blk == end_blk) {
-				bio_endio(bt->parent_bio);
-				goto bio_done;
-			}
-
-			/* total splits > 0 and it's now last blk of bio */
-			if (atomic_read(&bio->__bi_remaining) > 1 &&
-			    cur_blk == end_blk) {
-				atomic_dec(&bio->__bi_remaining);
+			/*
+			 * last blk of bio, complete it once all splits (if
+			 * any) have completed as well.
+			 */
+			if (cur_blk == end_blk) {
+				bio_endio(bio);
 				goto bio_submitted_lastbio;
 			}
 
 			continue;
 		}
 
-		/* write unallocated space, allocate a new block */
-		if (rw && 0 == binfo->device) {
-			tier_dev_allocate(dev, cur_blk, binfo, bt);
-
-			if (0 == binfo->device) {
+		if (locked) {
+			/* write unallocated space, allocate a new block */
+			if (rw && 0 == binfo->device) {
+				binfo_write_begin(binfo);
+				tier_dev_allocate(dev, cur_blk, binfo, bt);
+				binfo_write_end(binfo);
+
+				if (0 == binfo->device) {
+					/* couldn't allocate, fail the bio */
+					mutex_unlock(tier_block_lock(dev,
+								     cur_blk));
+					bio->bi_error =
+					    dev->inerror ? -EIO : -ENOSPC;
+					goto bio_failed;
+				}
+			} else if (rw && BLKSIZE == size_in_blk) {
 				/*
-				 * couldn't allocate, error.
-				 * need more error handling here.
+				 * the whole block is overwritten, when it
+				 * belongs on a faster tier write it there
+				 * instead of copying it later.
 				 */
-				bio_endio(bt->parent_bio);
-				goto bio_done;
+				device = binfo->device;
+				newdevice = overwrite_target(dev, binfo);
+				if (newdevice)
+					tier_dev_redirect(dev, cur_blk, binfo,
+							  bt, newdevice);
+				if (binfo->device != device) {
+					/* the data is on the new block */
+					trim_clear(dev, cur_blk, 0, BLKSIZE);
+					mutex_unlock(tier_block_lock(dev,
+								     cur_blk));
+					bio_advance(bio, BLKSIZE);
+					if (cur_blk == end_blk) {
+						bio_endio(bio);
+						goto bio_submitted_lastbio;
+					}
+					continue;
+				}
 			}
+			device = binfo->device;
+			phys = binfo->offset;
 		}
 
-		/* access allocated block, split bio within it */
+		if (rw)
+			trim_clear(dev, cur_blk, offset_in_blk, size_in_blk);
+
+		last_blk = cur_blk;
+		if (cur_blk != end_blk)
+			size_in_blk = tier_extend_run(dev, bio, rw, cur_blk,
+						      end_blk, device, phys,
+						      size_in_blk, &last_blk);
+
+		/* access allocated blocks, split bio within them */
 		done = 0;
 		cur_chunk = 0;
 		start = 0;
-		device = binfo->device - 1;
+		device--;
 
 		do {
-			cur_chunk =
-			    get_chunksize(dev->backdev[device]->bdev, bio);
-			if (cur_chunk > (size_in_blk - done))
-				cur_chunk = size_in_blk - done;
+			cur_chunk = get_chunksize(dev->backdev[device], bio,
+						  size_in_blk - done);
 
 			/* if no splits, and it's now last blk of bio */
 			if (1 == atomic_read(&bio->__bi_remaining) &&
-			    cur_blk == end_blk && cur_chunk == size_in_blk) {
-				start = (binfo->offset + offset_in_blk) >> 9;
-				mutex_unlock(dev->block_lock + cur_blk);
+			    last_blk == end_blk && cur_chunk == size_in_blk) {
+				start = (phys + offset_in_blk) >> 9;
+				tier_unlock_run(dev, cur_blk, last_blk, locked,
+						rw);
 				tier_submit_bio(dev, device, bio, start);
 				goto bio_submitted_lastbio;
 			}
@@ -607,16 +1331,15 @@ static void tiered_dev_access(struct tier_device *dev, struct bio_task *bt)
 			split = bio_next_split(bio, cur_chunk >> 9, GFP_NOIO,
 					       fs_bio_set);
 			if (split == bio) {
-				BUG_ON(cur_blk != end_blk);
-				start =
-				    (binfo->offset + offset_in_blk + done) >> 9;
-				mutex_unlock(dev->block_lock + cur_blk);
+				BUG_ON(last_blk != end_blk);
+				start = (phys + offset_in_blk + done) >> 9;
+				tier_unlock_run(dev, cur_blk, last_blk, locked,
+						rw);
 				tier_submit_bio(dev, device, bio, start);
 				goto bio_submitted_lastbio;
 			} else {
 				bio_chain(split, bio);
-				start =
-				    (binfo->offset + offset_in_blk + done) >> 9;
+				start = (phys + offset_in_blk + done) >> 9;
 				tier_submit_bio(dev, device, split, start);
 			}
 
@@ -624,19 +1347,94 @@ static void tiered_dev_access(struct tier_device *dev, struct bio_task *bt)
 		} while (done != size_in_blk);
 
 		/* splitting in current block is done, go to next block.*/
-		mutex_unlock(dev->block_lock + cur_blk);
+		tier_unlock_run(dev, cur_blk, last_blk, locked, rw);
 	}
 
 	return;
 
-bio_done:
-	mempool_free(bt, dev->bio_task);
-	atomic_dec(&dev->aio_pending);
-	wake_up(&dev->aio_event);
+bio_failed:
+	/*
+	 * the rest of the bio is skipped, the parent completes once the
+	 * splits that were submitted already have completed as well.
+	 */
+	bio_endio(bio);
 bio_submitted_lastbio:
 	return;
 }
 
+static void remap_endio(struct bio *bio)
+{
+	struct bio_remap *br = bio->bi_private;
+	struct tier_device *dev = br->dev;
+
+	bio->bi_end_io = br->bi_end_io;
+	bio->bi_private = br->bi_private;
+	mempool_free(br, dev->bio_remap);
+
+	bio_endio(bio);
+	atomic_dec(&dev->aio_pending);
+	wake_up(&dev->aio_event);
+}
+
+/*
+ * A bio that lies within one allocated block and needs no split for the
+ * backing device is remapped and submitted as is, without cloning it into
+ * a bio_task. Returns false when the bio has to take the tiered_dev_access
+ * path.
+ */
+static bool tier_remap_bio(struct tier_device *dev, struct bio *bio, int rw)
+{
+	u64 blocknr = bio->bi_iter.bi_sector >> (BLK_SHIFT - 9);
+	struct blockinfo *binfo = blocklist_entry(dev, blocknr);
+	unsigned int offset_in_blk;
+	unsigned int device;
+	struct bio_remap *br;
+	u64 phys;
+
+	if (blocknr != (bio_end_sector(bio) - 1) >> (BLK_SHIFT - 9))
+		return false;
+
+	/* writes may race with discard of the block, reads don't care */
+	if (rw)
+		mutex_lock(tier_block_lock(dev, blocknr));
+
+	if (!binfo_read_mapping(dev, binfo, &device, &phys) || 0 == device)
+		goto fallback;
+	if (get_chunksize(dev->backdev[device - 1], bio,
+			  bio->bi_iter.bi_size) < bio->bi_iter.bi_size)
+		goto fallback;
+	/* tiered_dev_access redirects the overwrite of a whole block */
+	if (rw && BLKSIZE == bio->bi_iter.bi_size &&
+	    overwrite_target(dev, binfo))
+		goto fallback;
+
+	increase_iostats(dev, rw, determine_iotype(dev, blocknr));
+	update_blockinfo_stats(dev, blocknr, binfo, device,
+			       rw ? TIERWRITE : TIERREAD);
+
+	offset_in_blk = (bio->bi_iter.bi_sector << 9) - (blocknr << BLK_SHIFT);
+	if (rw)
+		trim_clear(dev, blocknr, offset_in_blk, bio->bi_iter.bi_size);
+
+	br = mempool_alloc(dev->bio_remap, GFP_NOIO);
+	br->dev = dev;
+	br->bi_end_io = bio->bi_end_io;
+	br->bi_private = bio->bi_private;
+	bio->bi_end_io = remap_endio;
+	bio->bi_private = br;
+
+	tier_submit_bio(dev, device - 1, bio, (phys + offset_in_blk) >> 9);
+
+	if (rw)
+		mutex_unlock(tier_block_lock(dev, blocknr));
+	return true;
+
+fallback:
+	if (rw)
+		mutex_unlock(tier_block_lock(dev, blocknr));
+	return false;
+}
+
 static inline struct bio_task *task_alloc(struct tier_device *dev,
 					  struct bio *parent_bio)
 {
@@ -684,6 +1482,21 @@ blk_qc_t tier_make_request(struct request_queue *q, struct bio *parent_bio)
 		      bio_sectors(parent_bio));
 	part_stat_unlock();
 
+	/*
+	 * The blocklist segments of the bio have to be in memory before it
+	 * is mapped, a discard is handled on btier_wq anyway.
+	 */
+	if (parent_bio->bi_iter.bi_size && !(parent_bio->bi_rw & REQ_DISCARD))
+		tier_dev_load(dev, parent_bio);
+
+	/*
+	 * reads of unallocated space complete right away, the qlock that we
+	 * hold keeps data migration away.
+	 */
+	if (!rw && parent_bio->bi_iter.bi_size &&
+	    tier_read_hole(dev, parent_bio))
+		goto end_return;
+
 	/* increase aio_pending for each bio */
 	atomic_inc(&dev->aio_pending);
 
@@ -695,6 +1508,9 @@ blk_qc_t tier_make_request(struct request_queue *q, struct bio *parent_bio)
 			goto end_return;
 		}
 
+		if (tier_remap_bio(dev, parent_bio, rw))
+			goto end_return;
+
 		bt = task_alloc(dev, parent_bio);
 
 		tiered_dev_access(dev, bt);
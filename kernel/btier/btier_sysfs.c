@@ -354,6 +354,41 @@ static ssize_t tier_attr_migrate_verbose_store(struct tier_device *dev,
 	return s;
 }
 
+static ssize_t tier_attr_defrag_rate_store(struct tier_device *dev,
+					   const char *buf, size_t s)
+{
+	unsigned int rate;
+	char *cpybuf;
+
+	cpybuf = null_term_buf(buf, s);
+	if (!cpybuf)
+		return -ENOMEM;
+	if (1 == sscanf(cpybuf, "%u", &rate))
+		dev->defrag_rate = rate;
+	else
+		s = -ENOMSG;
+	kfree(cpybuf);
+	return s;
+}
+
+static ssize_t tier_attr_blocklist_cache_mb_store(struct tier_device *dev,
+						  const char *buf, size_t s)
+{
+	unsigned int mb;
+	char *cpybuf;
+
+	cpybuf = null_term_buf(buf, s);
+	if (!cpybuf)
+		return -ENOMEM;
+	if (1 == sscanf(cpybuf, "%u", &mb)) {
+		dev->blocklist_cache_mb = mb;
+		wake_up(&dev->migrate_event);
+	} else
+		s = -ENOMSG;
+	kfree(cpybuf);
+	return s;
+}
+
 static ssize_t tier_attr_migration_policy_store(struct tier_device *dev,
 						const char *buf, size_t s)
 {
@@ -546,10 +581,12 @@ static ssize_t tier_attr_show_blockinfo_show(struct tier_device *dev, char *buf)
 	u64 maxblocks = dev->size >> BLK_SHIFT;
 	u64 blocknr = dev->user_selected_blockinfo;
 
+	/* keeps the segments from being evicted */
+	down_read(&dev->qlock);
 	for (i = 0; i < MAXPAGESHOW; i++) {
 		binfo = get_blockinfo(dev, blocknr, 0);
 		if (!binfo)
-			return res;
+			break;
 		len = sprintf(buf + res, "%i,%llu,%lu,%u,%u\n",
 			      binfo->device - 1, binfo->offset, binfo->lastused,
 			      binfo->readcount, binfo->writecount);
@@ -560,6 +597,7 @@ static ssize_t tier_attr_show_blockinfo_show(struct tier_device *dev, char *buf)
 		if (blocknr >= maxblocks)
 			break;
 	}
+	up_read(&dev->qlock);
 	return res;
 }
 
@@ -604,6 +642,37 @@ static ssize_t tier_attr_migrate_verbose_show(struct tier_device *dev,
 	return sprintf(buf, "%i\n", dev->migrate_verbose);
 }
 
+static ssize_t tier_attr_defrag_rate_show(struct tier_device *dev, char *buf)
+{
+	return sprintf(buf, "%u\n", dev->defrag_rate);
+}
+
+static ssize_t tier_attr_blocklist_cache_mb_show(struct tier_device *dev,
+						 char *buf)
+{
+	u64 resident = atomic64_read(&dev->blocklist_memory);
+
+	return sprintf(buf, "%u (%llu in use)\n", dev->blocklist_cache_mb,
+		       resident >> 20);
+}
+
+static ssize_t tier_attr_fragmentation_show(struct tier_device *dev, char *buf)
+{
+	unsigned int i;
+	u64 runlength, mb;
+	int len;
+
+	len = sprintf(buf, "%7s %20s %15s\n", "TIER", "DEVICE", "AVG RUN MB");
+	for (i = 0; i < dev->attached_devices; i++) {
+		runlength = fragmentation_of_device(dev, i);
+		mb = btier_div(runlength, 100);
+		len += sprintf(buf + len, "%7u %20s %12llu.%02llu\n", i,
+			       dev->backdev[i]->fds->f_path.dentry->d_name.name,
+			       mb, runlength - mb * 100);
+	}
+	return len;
+}
+
 static ssize_t tier_attr_migration_policy_show(struct tier_device *dev,
 					       char *buf)
 {
@@ -741,12 +810,15 @@ TIER_ATTR_RW(discard);
 TIER_ATTR_RW(migration_interval);
 TIER_ATTR_RW(migration_enable);
 TIER_ATTR_RW(migration_policy);
+TIER_ATTR_RW(defrag_rate);
+TIER_ATTR_RW(blocklist_cache_mb);
 TIER_ATTR_RW(resize);
 TIER_ATTR_RO(size_in_blocks);
 TIER_ATTR_RO(attacheddevices);
 TIER_ATTR_RO(numreads);
 TIER_ATTR_RO(numwrites);
 TIER_ATTR_RO(device_usage);
+TIER_ATTR_RO(fragmentation);
 TIER_ATTR_RO(uuid);
 TIER_ATTR_RO(internals);
 TIER_ATTR_RW(show_blockinfo);
@@ -761,10 +833,13 @@ struct attribute *tier_attrs[] = {
     &tier_attr_migration_interval.attr,
     &tier_attr_migration_enable.attr,
     &tier_attr_migration_policy.attr,
+    &tier_attr_defrag_rate.attr,
+    &tier_attr_blocklist_cache_mb.attr,
     &tier_attr_attacheddevices.attr,
     &tier_attr_numreads.attr,
     &tier_attr_numwrites.attr,
     &tier_attr_device_usage.attr,
+    &tier_attr_fragmentation.attr,
     &tier_attr_resize.attr,
     &tier_attr_clear_statistics.attr,
     &tier_attr_size_in_blocks.attr,
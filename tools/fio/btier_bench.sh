@@ -0,0 +1,259 @@
+#!/bin/bash
+#
+# btier_bench.sh : reproducible fio benchmark of a btier device.
+#
+# Creates a btier device on top of ram (brd), null_blk or loop backed
+# tiers. Every tier can be given an artificial latency with dm-delay so
+# that a SSD/SAS/SATA hierarchy can be emulated on any machine.
+# The workloads in btier_bench.fio are run one after the other and the
+# results are written as JSON lines, one line for the btier device and
+# one line per tier device for every workload. Results of two commits
+# can be compared with for example:
+#   jq -s 'group_by(.workload)' before.json after.json
+#
+# Requires : fio, jq, dmsetup, btier_setup and the btier module.
+#
+
+BENCHDIR=$(dirname $(readlink -f $0))
+FIOJOB=$BENCHDIR/btier_bench.fio
+WORKLOADS="first-write overwrite rand-read seq-read mixed flush-heavy"
+
+BACKEND=ram
+TIERS=3
+TIERSIZE=1024
+DELAYS="0:1:8"
+RUNTIME=30
+OUTPUT=btier_bench.json
+LOOPDIR=/dev/shm
+LABEL=$(cd $BENCHDIR && git rev-parse --short HEAD 2>/dev/null)
+
+RAWDEVS=()
+TIERDEVS=()
+DMDEVS=()
+LOOPFILES=()
+BTIERDEV=
+
+usage()
+{
+  echo "Usage : $0 [-b ram|null|loop] [-n tiers] [-s tiersize MB]"
+  echo "           [-d delay0:delay1:.. ms] [-r runtime sec]"
+  echo "           [-w workload,workload] [-l label] [-o output.json]"
+  echo "Workloads : $WORKLOADS"
+  exit 1
+}
+
+die()
+{
+  echo "btier_bench : $*" >&2
+  exit 1
+}
+
+cleanup()
+{
+  [ -n "$BTIERDEV" ] && btier_setup -d $BTIERDEV >/dev/null
+  for d in "${DMDEVS[@]}"; do
+    dmsetup remove $d
+  done
+  case $BACKEND in
+    ram)
+      rmmod brd 2>/dev/null
+      ;;
+    null)
+      for i in $(seq 0 $((TIERS - 1))); do
+        echo 0 >/sys/kernel/config/nullb/btier_bench$i/power 2>/dev/null
+        rmdir /sys/kernel/config/nullb/btier_bench$i 2>/dev/null
+      done
+      ;;
+    loop)
+      for d in "${RAWDEVS[@]}"; do
+        losetup -d $d
+      done
+      rm -f "${LOOPFILES[@]}"
+      ;;
+  esac
+}
+
+setup_ram()
+{
+  modprobe brd rd_nr=$TIERS rd_size=$((TIERSIZE * 1024)) ||
+    die "failed to load brd"
+  for i in $(seq 0 $((TIERS - 1))); do
+    RAWDEVS+=(/dev/ram$i)
+  done
+}
+
+setup_null()
+{
+  local nb
+
+  modprobe null_blk nr_devices=0 || die "failed to load null_blk"
+  for i in $(seq 0 $((TIERS - 1))); do
+    nb=/sys/kernel/config/nullb/btier_bench$i
+    mkdir $nb || die "null_blk needs configfs support"
+    echo $TIERSIZE >$nb/size
+    echo 1 >$nb/memory_backed
+    echo 1 >$nb/power
+    RAWDEVS+=(/dev/nullb$(cat $nb/index))
+  done
+}
+
+setup_loop()
+{
+  local f
+
+  for i in $(seq 0 $((TIERS - 1))); do
+    f=$LOOPDIR/btier_bench$i.img
+    truncate -s ${TIERSIZE}M $f || die "failed to create $f"
+    LOOPFILES+=($f)
+    RAWDEVS+=($(losetup --show -f --direct-io=on $f)) ||
+      die "failed to setup a loop device for $f"
+  done
+}
+
+# Put a dm-delay target in front of every raw device
+setup_delay()
+{
+  local delays=(${DELAYS//:/ })
+  local sectors name ms
+
+  for i in $(seq 0 $((TIERS - 1))); do
+    ms=${delays[$i]:-0}
+    if [ "$ms" = "0" ]; then
+      TIERDEVS+=(${RAWDEVS[$i]})
+      continue
+    fi
+    name=btier_bench_delay$i
+    sectors=$(blockdev --getsz ${RAWDEVS[$i]})
+    echo "0 $sectors delay ${RAWDEVS[$i]} 0 $ms" | dmsetup create $name ||
+      die "failed to create dm-delay device for ${RAWDEVS[$i]}"
+    DMDEVS+=($name)
+    TIERDEVS+=(/dev/mapper/$name)
+  done
+}
+
+setup_btier()
+{
+  local before after
+
+  before=$(ls /sys/block | grep sdtier)
+  btier_setup -f $(IFS=:; echo "${TIERDEVS[*]}") -c >/dev/null ||
+    die "btier_setup failed"
+  after=$(ls /sys/block | grep sdtier)
+  BTIERDEV=/dev/$(comm -13 <(echo "$before") <(echo "$after") | head -1)
+  [ "$BTIERDEV" = "/dev/" ] && die "no btier device was created"
+  # Keep migration out of the measurements
+  echo 0 >/sys/block/$(basename $BTIERDEV)/tier/migration_enable
+}
+
+# /sys/block/X/stat of the kernel device behind a tier
+devstat()
+{
+  cat /sys/block/$(basename $(readlink -f $1))/stat
+}
+
+# Emit one JSON line per tier from the stat counters before and after
+tier_results()
+{
+  local workload=$1
+  shift
+  local i=0 before after
+
+  for d in "${TIERDEVS[@]}"; do
+    before=(${1})
+    after=($(devstat $d))
+    jq -cn --arg label "$LABEL" --arg workload $workload \
+      --arg device $d --argjson tier $i \
+      --argjson rios $((after[0] - before[0])) \
+      --argjson rticks $((after[3] - before[3])) \
+      --argjson rsect $((after[2] - before[2])) \
+      --argjson wios $((after[4] - before[4])) \
+      --argjson wticks $((after[7] - before[7])) \
+      --argjson wsect $((after[6] - before[6])) \
+      '{label: $label, workload: $workload, device: $device, tier: $tier,
+        read_ios: $rios, read_mb: ($rsect * 512 / 1048576),
+        read_await_ms: (if $rios > 0 then $rticks / $rios else 0 end),
+        write_ios: $wios, write_mb: ($wsect * 512 / 1048576),
+        write_await_ms: (if $wios > 0 then $wticks / $wios else 0 end)}'
+    shift
+    let i++
+  done
+}
+
+# Reduce the fio json output to iops and completion latency percentiles
+fio_results()
+{
+  local workload=$1 fiojson=$2
+
+  jq -c --arg label "$LABEL" --arg workload $workload \
+    --arg device $BTIERDEV '
+    def lat(d): (d.clat_ns.percentile // d.clat.percentile // {}) as $p |
+      (if d.clat_ns then 1000 else 1 end) as $div |
+      {p50: (($p["50.000000"] // 0) / $div),
+       p90: (($p["90.000000"] // 0) / $div),
+       p99: (($p["99.000000"] // 0) / $div),
+       p99_9: (($p["99.900000"] // 0) / $div),
+       p99_99: (($p["99.990000"] // 0) / $div)};
+    .jobs[0] | {label: $label, workload: $workload, device: $device,
+      read_iops: .read.iops, read_bw_kb: .read.bw, read_lat_us: lat(.read),
+      write_iops: .write.iops, write_bw_kb: .write.bw,
+      write_lat_us: lat(.write)}' $fiojson
+}
+
+run_workload()
+{
+  local workload=$1
+  local stats=() fiojson
+
+  for d in "${TIERDEVS[@]}"; do
+    stats+=("$(devstat $d)")
+  done
+  fiojson=$(mktemp)
+  BTIER_DEV=$BTIERDEV BTIER_SIZE=$FIOSIZE BTIER_RUNTIME=$RUNTIME \
+    fio --section=$workload --output-format=json --output=$fiojson \
+    $FIOJOB || die "fio failed on workload $workload"
+  fio_results $workload $fiojson >>$OUTPUT
+  tier_results $workload "${stats[@]}" >>$OUTPUT
+  rm -f $fiojson
+}
+
+while getopts "b:n:s:d:r:w:l:o:h" opt; do
+  case $opt in
+    b) BACKEND=$OPTARG ;;
+    n) TIERS=$OPTARG ;;
+    s) TIERSIZE=$OPTARG ;;
+    d) DELAYS=$OPTARG ;;
+    r) RUNTIME=$OPTARG ;;
+    w) WORKLOADS=${OPTARG//,/ } ;;
+    l) LABEL=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+[ $(id -u) -eq 0 ] || die "must be run as root"
+for t in fio jq dmsetup btier_setup; do
+  which $t >/dev/null || die "$t not found"
+done
+[ -c /dev/tiercontrol ] || modprobe btier || die "btier is not loaded"
+[ -z "$LABEL" ] && LABEL=unknown
+
+trap cleanup EXIT
+
+case $BACKEND in
+  ram) setup_ram ;;
+  null) setup_null ;;
+  loop) setup_loop ;;
+  *) usage ;;
+esac
+setup_delay
+setup_btier
+
+# Only use half the size of a tier, so that first-write never runs out
+# of tier 0 when sequential_landing is not changed.
+FIOSIZE=$((TIERSIZE / 2))M
+
+for w in $WORKLOADS; do
+  echo "btier_bench : $LABEL $w"
+  run_workload $w
+done
+echo "btier_bench : results written to $OUTPUT"